@@ -0,0 +1,164 @@
+/*
+ * Throughput of the streaming authorized_keys parser.
+ * Builds a synthetic file of a few MB (plain keys, keys with quoted
+ * options, comments, blank and CRLF lines) and feeds it to keystream_feed()
+ * in chunks of several sizes, as a remote cat would deliver it. Every chunk
+ * size must see the same keys; the best of a few runs is reported.
+ *
+ *   make bench
+ *   bench/keystream [megabytes]
+ */
+
+/* The program's own main() is not wanted here */
+#define main ssh_copy_id_main
+#include "../ssh-copy-id.c"
+#undef main
+
+#define BENCH_RUNS 5
+
+static const size_t bench_chunks[] = { 512, 4096, 65536, 1 << 20, 0 };
+
+typedef struct {
+    unsigned long keys;
+    unsigned long bytes;
+} BenchCount;
+
+/* CPU time in milliseconds; the runs are single-threaded and CPU-bound */
+static double bench_ms(void) {
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+static uint32_t bench_seed = 2463534242u;
+
+/* xorshift32: the same file on every run */
+static uint32_t bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+static void bench_text(Buffer *buf, const char *text) {
+    buffer_append(buf, text, strlen(text));
+}
+
+static void bench_blob(Buffer *buf, size_t len) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char chunk[1024];
+    size_t i;
+    
+    buffer_append(buf, "AAAA", 4);
+    for (i = 0; i < len && i < sizeof(chunk); i++) {
+        chunk[i] = alphabet[bench_random() & 63];
+    }
+    buffer_append(buf, chunk, i);
+}
+
+/* One line of the synthetic file, cycling through the shapes parsed; 1 if it holds a key */
+static int bench_line(Buffer *buf, unsigned long n) {
+    char text[128];
+    int len;
+    
+    switch (n % 8) {
+    case 0:
+        len = snprintf(text, sizeof(text), "# team %lu\n", n);
+        buffer_append(buf, text, (size_t)len);
+        return 0;
+    case 1:
+        bench_text(buf, "\n");
+        return 0;
+    case 2:
+        bench_text(buf, "from=\"10.0.0.0/8,192.168.1.1\",command=\"echo \\\"hi\\\"\",no-pty ");
+        break;
+    case 3:
+        bench_text(buf, "cert-authority ");
+        break;
+    }
+    if (n % 3 == 0) {
+        bench_text(buf, "ssh-rsa ");
+        bench_blob(buf, 368);
+    } else {
+        bench_text(buf, "ssh-ed25519 ");
+        bench_blob(buf, 64);
+    }
+    len = snprintf(text, sizeof(text), " user%lu@host%lu%s\n", n, n % 97,
+                   n % 5 == 0 ? "\r" : "");
+    buffer_append(buf, text, (size_t)len);
+    return 1;
+}
+
+static void bench_count(const KeyLine *key, void *ctx) {
+    BenchCount *count = ctx;
+    
+    if (key->kind == KEYLINE_KEY) {
+        count->keys++;
+        count->bytes += (unsigned long)key->blob.len;
+    }
+}
+
+/* Parse `data` once in chunks of `chunk` bytes (0: all at once) */
+static double bench_feed(const Buffer *data, size_t chunk, BenchCount *count) {
+    KeyStream stream;
+    double start = bench_ms();
+    size_t pos;
+    size_t len;
+    
+    memset(count, 0, sizeof(*count));
+    keystream_init(&stream, bench_count, count);
+    for (pos = 0; pos < data->len; pos += len) {
+        len = chunk && data->len - pos > chunk ? chunk : data->len - pos;
+        keystream_feed(&stream, data->data + pos, len);
+    }
+    keystream_end(&stream);
+    return bench_ms() - start;
+}
+
+int main(int argc, char *argv[]) {
+    Buffer data = { NULL, 0, 0, NULL, NULL };
+    BenchCount first;
+    BenchCount count;
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 16) << 20;
+    unsigned long lines;
+    unsigned long keys = 0;
+    double best;
+    double ms;
+    int i;
+    int run;
+    
+    for (lines = 0; data.len < size; lines++) {
+        keys += (unsigned long)bench_line(&data, lines);
+    }
+    bench_feed(&data, 0, &first);
+    if (first.keys != keys) {
+        fprintf(stderr, "%lu keys parsed, expected %lu\n", first.keys, keys);
+        return 1;
+    }
+    printf("keystream_feed: %.1f MB, %lu lines, %lu keys, scanner %s\n",
+           (double)data.len / (1 << 20), lines, first.keys, scanner_get()->name);
+    printf("%10s %10s %10s\n", "chunk", "ms", "MB/s");
+    
+    for (i = 0; i < (int)(sizeof(bench_chunks) / sizeof(bench_chunks[0])); i++) {
+        best = 0;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            ms = bench_feed(&data, bench_chunks[i], &count);
+            if (count.keys != first.keys || count.bytes != first.bytes) {
+                fprintf(stderr, "chunk %lu: %lu keys, expected %lu\n",
+                        (unsigned long)bench_chunks[i], count.keys, keys);
+                return 1;
+            }
+            if (run == 0 || ms < best) {
+                best = ms;
+            }
+        }
+        if (bench_chunks[i]) {
+            printf("%10lu", (unsigned long)bench_chunks[i]);
+        } else {
+            printf("%10s", "whole");
+        }
+        printf(" %10.2f %10.1f\n", best,
+               best > 0 ? (double)data.len / (1 << 20) / (best / 1000.0) : 0.0);
+    }
+    buffer_free(&data);
+    return 0;
+}
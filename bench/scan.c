@@ -0,0 +1,132 @@
+/*
+ * Throughput of the scalar, SSE2 and AVX2 scanners on an
+ * authorized_keys-like buffer: splitting it into lines, and stepping
+ * over the base64 runs the way the blob field is found.
+ *
+ *   make bench
+ *   bench/scan [megabytes]
+ */
+
+/* The program's own main() is not wanted here */
+#define main ssh_copy_id_main
+#include "../ssh-copy-id.c"
+#undef main
+
+#define BENCH_RUNS 5
+
+/* CPU time in milliseconds; the runs are single-threaded and CPU-bound */
+static double bench_ms(void) {
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+static uint32_t bench_seed = 2463534242u;
+
+/* xorshift32: the same buffer on every run */
+static uint32_t bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+/* "type AAAA<base64> comment" lines with 64 to 512 bytes of blob */
+static void bench_fill(char *buf, size_t len) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const char head[] = "ssh-ed25519 AAAA";
+    static const char tail[] = " user@host\n";
+    size_t i = 0;
+    size_t run;
+    
+    while (i < len) {
+        memcpy(buf + i, head, len - i < sizeof(head) - 1 ? len - i : sizeof(head) - 1);
+        i += sizeof(head) - 1;
+        for (run = 64 + bench_random() % 448; run > 0 && i < len; run--) {
+            buf[i++] = alphabet[bench_random() & 63];
+        }
+        if (i < len) {
+            memcpy(buf + i, tail, len - i < sizeof(tail) - 1 ? len - i : sizeof(tail) - 1);
+        }
+        i += sizeof(tail) - 1;
+    }
+}
+
+static unsigned long bench_lines(const Scanner *scanner, const char *p, const char *end) {
+    unsigned long n = 0;
+    
+    for (; p < end; p++, n++) {
+        p = scanner->newline(p, end);
+    }
+    return n;
+}
+
+static unsigned long bench_runs(const Scanner *scanner, const char *p, const char *end) {
+    unsigned long n = 0;
+    
+    for (; p < end; p++, n++) {
+        p = scanner->base64(p, end);
+    }
+    return n;
+}
+
+/* Best of a few runs, in ms; the count must agree with the scalar scan */
+static double bench_time(unsigned long (*scan)(const Scanner *, const char *, const char *),
+                         const Scanner *scanner, const char *buf, size_t len,
+                         unsigned long want) {
+    double best = 0;
+    double ms;
+    int run;
+    
+    for (run = 0; run < BENCH_RUNS; run++) {
+        ms = bench_ms();
+        if (scan(scanner, buf, buf + len) != want) {
+            fprintf(stderr, "%s: count differs from the scalar scan\n", scanner->name);
+            exit(1);
+        }
+        ms = bench_ms() - ms;
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+static void bench_scanner(const Scanner *scanner, const char *buf, size_t len,
+                          unsigned long lines, unsigned long runs) {
+    double mb = (double)len / (1 << 20);
+    double split = bench_time(bench_lines, scanner, buf, len, lines);
+    double blobs = bench_time(bench_runs, scanner, buf, len, runs);
+    
+    printf("%8s %10.2f %10.1f %10.2f %10.1f\n", scanner->name,
+           split, split > 0 ? mb / (split / 1000.0) : 0.0,
+           blobs, blobs > 0 ? mb / (blobs / 1000.0) : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    static const Scanner scalar = { "scalar", scan_newline_scalar, scan_base64_scalar };
+    size_t len = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+    char *buf = malloc(len);
+    unsigned long lines;
+    unsigned long runs;
+    
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    bench_fill(buf, len);
+    lines = bench_lines(&scalar, buf, buf + len);
+    runs = bench_runs(&scalar, buf, buf + len);
+    printf("scanners: %.1f MB, %lu lines, %lu base64 runs\n",
+           (double)len / (1 << 20), lines, runs);
+    printf("%8s %10s %10s %10s %10s\n", "", "lines ms", "MB/s", "base64 ms", "MB/s");
+    
+    bench_scanner(&scalar, buf, len, lines, runs);
+#ifdef HAVE_SCAN_SIMD
+    bench_scanner(&scanner_sse2, buf, len, lines, runs);
+    if (cpu_has_avx2()) {
+        bench_scanner(&scanner_avx2, buf, len, lines, runs);
+    }
+#endif
+    free(buf);
+    return 0;
+}
@@ -1,22 +1,124 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
 /*
  * ssh-copy-id for Windows
  * Analog of ssh-copy-id utility from Linux
  * 
  * Compile:
  *   gcc -o ssh-copy-id.exe ssh-copy-id.c -lws2_32
+ *
+ * POSIX build (Linux, macOS):
+ *   gcc -o ssh-copy-id ssh-copy-id.c
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _WIN32
+/* STARTUPINFOEX and the inherited-handle list need Vista or later */
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
 #include <winsock2.h>
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+#endif
 #include <sys/stat.h>
+#ifdef USE_LIBSSH2
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#include <conio.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#include <termios.h>
+#endif
+#include <stdarg.h>
+#include <libssh2.h>
+#endif
+/* SSE2 is part of x86-64; AVX2 is chosen at run time */
+#if defined(__SSE2__) || defined(_M_X64)
+#define HAVE_SCAN_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef _WIN32
+#define PATH_SEP "\\"
+#define NULL_DEVICE "nul"
+#define USER_ENV "USERNAME"
+#define HOME_ENV "USERPROFILE"
+#else
+#define PATH_SEP "/"
+#define NULL_DEVICE "/dev/null"
+#define USER_ENV "USER"
+#define HOME_ENV "HOME"
+#define WSACleanup() ((void)0)
+extern char **environ;
+/* Win32-OpenSSH has no ControlMaster support, so multiplexing is POSIX-only */
+#define HAVE_CONTROL_MASTER
+#endif
+
+#ifdef USE_LIBSSH2
+#ifdef _WIN32
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#define poll_sockets WSAPoll
+#define connect_pending() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#define poll_sockets poll
+#define connect_pending() (errno == EINPROGRESS)
+#endif
+#endif
 
 #define MAX_PATH_LEN 4096
 #define MAX_CMD_LEN 8192
-#define MAX_KEY_SIZE 65536
+
+/* Exit codes of the remote install script */
+#define INSTALL_ADDED        0
+#define INSTALL_PRESENT      10
+#define INSTALL_NO_SSH_DIR   11
+#define INSTALL_WRITE_FAILED 12
+#define INSTALL_NO_AWK       13
+#define SYNC_UNCHANGED       20 /* --sync: the managed keys were already right */
+#define INSTALL_UNCHANGED    21 /* authorized_keys is as it was when last confirmed */
+#define REMOVE_NOT_FOUND     22 /* --remove: none of the keys was there */
+#define CHECK_MISSING        23 /* --check: some of the keys are not there */
+#define SSH_CONNECT_FAILED   255
+/* Not from the server: the state cache says the key is already there */
+#define INSTALL_CACHED       1
+
+/* Separates the old keys from the new on the stdin of a --rotate */
+#define ROTATE_MARKER "# ssh-copy-id: new keys"
+
+#define DEFAULT_JOBS 10
+#define MAX_JOBS 10000
 
 /* Options structure */
 typedef struct {
@@ -30,25 +132,512 @@ typedef struct {
     int quiet;
     char ssh_options[1024];
     char ssh_config[MAX_PATH_LEN];
+    int no_mux;
+    char control_path[MAX_PATH_LEN];
+    char hosts_file[MAX_PATH_LEN];
+    int jobs;
+    int no_cache;
+    int sync;
+    int remove;
+    int rotate;
+    char rotate_from[MAX_PATH_LEN];
+    int audit;
+    char audit_file[MAX_PATH_LEN];
+    char where_is[64];
+    char keys_on[520];
+    int check;
+    int timings;
 } Options;
 
+/* Receives data appended to a Buffer that streams instead of storing */
+typedef int (*BufferSink)(void *ctx, const char *data, size_t len);
+
+/*
+ * Growable byte buffer, e.g. for captured child output. With a sink set,
+ * appended data goes straight to the sink and the buffer stays empty.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    BufferSink sink;
+    void *sink_ctx;
+} Buffer;
+
+/* Where a spawned child's stdout and stderr go (flags) */
+#define CHILD_INHERIT     0 /* our own stdout and stderr */
+#define CHILD_CAPTURE     1 /* stdout into a pipe */
+#define CHILD_SILENT      2 /* stdout and stderr to the null device */
+#define CHILD_CAPTURE_ERR 4 /* stderr into a pipe of its own */
+#define CHILD_ASYNC       8 /* pipes usable by the event loop (overlapped on Windows) */
+
+#define SHA256_LEN 32
+/* "SHA256:" and 43 characters of unpadded base64 */
+#define FINGERPRINT_TEXT_LEN 51
+
+/* SHA-256 state */
+typedef struct {
+    uint32_t h[8];
+    uint64_t bits;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+/* A piece of a larger buffer; not NUL-terminated */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} StrView;
+
+/* What a line of an authorized_keys file holds */
+#define KEYLINE_BLANK   0
+#define KEYLINE_COMMENT 1
+#define KEYLINE_KEY     2
+#define KEYLINE_INVALID 3
+
+/* One parsed line, as views into the parsed buffer */
+typedef struct {
+    int kind;
+    unsigned long line_no;
+    StrView line;
+    StrView options;
+    StrView type;
+    StrView blob;
+    StrView comment;
+    int cert_authority;
+} KeyLine;
+
+/* Position in a buffer being parsed by keys_next() */
+typedef struct {
+    const char *pos;
+    const char *end;
+    unsigned long line_no;
+} KeyParser;
+
+/* Called for each line of a KeyStream */
+typedef void (*KeyLineFn)(const KeyLine *key, void *ctx);
+
+/* authorized_keys arriving in chunks, e.g. from a remote cat */
+typedef struct {
+    Buffer carry;
+    unsigned long line_no;
+    KeyLineFn line;
+    void *ctx;
+} KeyStream;
+
+/*
+ * Set of SHA-256 digests (key fingerprints, state ids). Members keep the
+ * index they were added at, so callers can keep data in a parallel array.
+ */
+typedef struct {
+    unsigned char (*items)[SHA256_LEN];
+    size_t count;
+    size_t capacity;
+    size_t *slots;
+    size_t slot_count;
+} FpSet;
+
+/* Last confirmed install of one key on one host */
+typedef struct {
+    unsigned char id[SHA256_LEN];
+    unsigned long long confirmed;
+    unsigned long long size;
+    unsigned long cksum;
+} StateRecord;
+
+/* The state file and the newest record per id, records[i] for ids.items[i] */
+typedef struct {
+    FILE *fp;
+    FpSet ids;
+    StateRecord *records;
+    size_t capacity;
+} StateCache;
+
+/* A spawned process and the parent ends of its pipes */
+typedef struct {
+#ifdef _WIN32
+    HANDLE process;
+    HANDLE in;
+    HANDLE out;
+    HANDLE err;
+#else
+    pid_t pid;
+    int in;
+    int out;
+    int err;
+#endif
+} Child;
+
+/* A child run by the event loop, with its collected output */
+typedef struct Job Job;
+typedef struct EventLoop EventLoop;
+typedef void (*JobDone)(Job *job, void *ctx);
+
+#ifndef _WIN32
+typedef struct {
+    Job *job;
+    int kind;
+} JobWatch;
+#endif
+
+struct Job {
+    EventLoop *loop;
+    Child child;
+    const char *input;
+    size_t input_len;
+    Buffer out;
+    Buffer err;
+    int status;
+    int exited;
+    JobDone done;
+    void *ctx;
+    Job *next;
+#ifdef _WIN32
+    OVERLAPPED ov_in;
+    OVERLAPPED ov_out;
+    OVERLAPPED ov_err;
+    OVERLAPPED ov_exit;
+    char out_chunk[4096];
+    char err_chunk[4096];
+    HANDLE wait;
+    int pending;
+#else
+    int pidfd;
+    JobWatch watch[4];
+#endif
+};
+
+struct EventLoop {
+    Job *jobs;
+    int active;
+#ifdef _WIN32
+    HANDLE iocp;
+#elif defined(__linux__)
+    int epfd;
+#endif
+};
+
+/*
+ * argv for one ssh invocation. Every string it points to, apart from the
+ * caller's extra arguments and remote command, lives in the struct itself.
+ */
+#define MAX_SSH_ARGS 32
+
+typedef struct {
+    char *argv[MAX_SSH_ARGS + 1];
+    int argc;
+    char port[16];
+    char config[MAX_PATH_LEN];
+    char ssh_options[1024];
+    char control_path[MAX_PATH_LEN + 16];
+    char destination[520];
+} SshArgv;
+
+/* Strings given on the command line: targets, -i key files */
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} TargetList;
+
+/*
+ * Where fleet workers take their next host from: the command-line targets,
+ * then the inventory file, which is read one line at a time as workers ask
+ * for more, so memory stays constant however long the file is.
+ */
+typedef struct {
+    const TargetList *args;
+    size_t arg_next;
+    FILE *inventory;
+    const char *inventory_path;
+    unsigned long line_no;
+} TargetSource;
+
+#ifdef USE_LIBSSH2
+/* ~/.ssh/known_hosts, parsed once per run */
+typedef struct {
+    LIBSSH2_KNOWNHOSTS *known;
+    char path[MAX_PATH_LEN];
+} KnownHosts;
+
+/* One host driven by the non-blocking libssh2 engine */
+typedef struct NativeJob NativeJob;
+typedef void (*NativeDone)(NativeJob *job, void *ctx);
+
+struct NativeJob {
+    const Options *opts;
+    const char *remote_cmd;
+    const char *input;
+    size_t input_len;
+    int state;
+    socket_t sock;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    LIBSSH2_AGENT *agent;
+    struct libssh2_agent_publickey *identity;
+    int trying;
+    int key_index;
+    time_t deadline;
+    Buffer out;
+    Buffer err;
+    int status;
+    NativeDone done;
+    void *ctx;
+    NativeJob *next;
+};
+
+typedef struct {
+    NativeJob *jobs;
+    int active;
+    LIBSSH2_SESSION *owner;
+    KnownHosts known;
+} NativeEngine;
+#endif
+
+/* Collects the lines of an authorized_keys whose key is one of `wanted` */
+typedef struct {
+    const FpSet *wanted;
+    Buffer *lines;
+} KeyMatch;
+
+/* A key seen by --audit: type and comment of its first sighting */
+typedef struct {
+    size_t type;
+    size_t comment;
+} AuditKey;
+
+/* A host --audit read, with its result and the number of keys found */
+typedef struct {
+    size_t user;
+    size_t host;
+    int port;
+    int status;
+    unsigned long keys;
+} AuditHost;
+
+/* One line of an authorized_keys holding a key */
+typedef struct {
+    size_t key;
+    size_t host;
+    unsigned long line_no;
+    size_t options;
+} AuditEntry;
+
+/*
+ * The inverted index --audit builds: every key line found on every host.
+ * Strings are NUL-terminated in one pool and referred to by offset. Once
+ * audit_sort() has run, hosts are ordered by name, user and port, entries
+ * by key fingerprint, host and line, and an entry's key is the rank of its
+ * fingerprint: key_order[entry.key] is the index in keys.
+ */
+typedef struct {
+    FpSet keys;
+    AuditKey *key_info;
+    size_t key_capacity;
+    size_t *key_order;
+    AuditHost *hosts;
+    size_t host_count;
+    size_t host_capacity;
+    AuditEntry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    Buffer strings;
+} Audit;
+
+/* A saved audit, mapped into memory and searched where it lies */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    uint32_t key_count;
+    uint32_t host_count;
+    uint32_t entry_count;
+    uint32_t strings_len;
+    const unsigned char *keys;
+    const unsigned char *hosts;
+    const unsigned char *entries;
+    const unsigned char *by_host;
+    const char *strings;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} Snapshot;
+
+/*
+ * Keys an inventory line names instead of the default set. They are read
+ * once and shared by all the hosts in a row naming the same file.
+ */
+typedef struct {
+    char key_path[MAX_PATH_LEN];
+    Buffer content;
+    unsigned char fingerprint[SHA256_LEN];
+    char script[MAX_CMD_LEN];
+    int refs;
+} KeySet;
+
+/* State of a fleet run */
+typedef struct {
+    const Options *base;
+    TargetSource *source;
+    const char *key_content;
+    unsigned char fingerprint[SHA256_LEN];
+    KeySet *inventory_keys;
+    StateCache *cache;
+    char script[MAX_CMD_LEN];
+    FpSet started;
+    EventLoop loop;
+#ifdef USE_LIBSSH2
+    NativeEngine native;
+#endif
+    int exhausted;
+    void *deferred;
+    unsigned long hosts;
+    const FpSet *fingerprints;
+    Audit *audit;
+    int added;
+    int present;
+    int failed;
+    int missing;
+    unsigned long removed;
+} Fleet;
+
+/*
+ * Steps of an install on one host; the last two only without awk there.
+ * A --remove by fingerprint fetches the file first to find the keys.
+ */
+#define FLEET_INSTALL 0
+#define FLEET_FETCH   1
+#define FLEET_APPEND  2
+
+/* One host being installed; lives until its last job is done */
+typedef struct {
+    Fleet *fleet;
+    Options opts;
+    SshArgv args;
+    const char *key_content;
+    const char *script;
+    char *own_script;
+    KeySet *own_keys;
+    unsigned char state_id[SHA256_LEN];
+    int phase;
+    KeyStream stream;
+    FpSet have;
+    Buffer payload;
+    KeyMatch match;
+    size_t audit_host;
+    int missing;
+    double started;
+    double step_started;
+} FleetHost;
+
 /* Function prototypes */
 void print_help(const char *prog_name);
 int parse_target(const char *target, Options *opts);
+int identity_key_path(const char *identity_file, char *key_path, size_t key_path_size);
 int get_public_key_path(Options *opts, char *key_path, size_t key_path_size);
-int read_public_key(const char *key_path, char *key_content, size_t key_size);
+int read_public_key(const char *key_path, Buffer *keys);
+int load_public_keys(const TargetList *key_files, Buffer *keys);
+int parse_fingerprint(const char *text, unsigned char fingerprint[SHA256_LEN]);
+void fingerprint_text(const unsigned char fingerprint[SHA256_LEN], char text[FINGERPRINT_TEXT_LEN]);
+int load_removals(const TargetList *key_files, Buffer *keys, FpSet *fingerprints);
+int load_rotation(const char *old_path, const TargetList *key_files, Buffer *input);
 int check_ssh_installed(void);
+int buffer_append(Buffer *buf, const char *data, size_t len);
+void buffer_free(Buffer *buf);
+int spawn_process(char *const argv[], int with_input, int output, Child *child);
+int wait_process(Child *child);
+int run_process(char *const argv[], const char *input, size_t input_len,
+                int output, Buffer *captured);
+int loop_init(EventLoop *loop);
+void loop_free(EventLoop *loop);
+int loop_spawn(EventLoop *loop, char *const argv[], const char *input, size_t input_len,
+               BufferSink sink, JobDone done, void *ctx);
+int loop_run_once(EventLoop *loop, int timeout_ms);
+void build_ssh_argv(Options *opts, const char *const extra[], const char *remote_cmd,
+                    SshArgv *args);
 int run_ssh_command(Options *opts, const char *remote_cmd);
-int copy_key_to_server(Options *opts, const char *key_content);
+int run_ssh_command_input(Options *opts, const char *remote_cmd,
+                          const char *input, size_t input_len, Buffer *captured);
+#ifdef USE_LIBSSH2
+int native_run(Options *opts, const char *key, const char *remote_cmd,
+               const char *input, size_t input_len, Buffer *out);
+int read_password(const char *prompt, char *buf, size_t size);
+int native_engine_init(NativeEngine *engine);
+void native_engine_free(NativeEngine *engine);
+int native_start(NativeEngine *engine, const Options *opts, const char *remote_cmd,
+                 const char *input, size_t input_len, BufferSink sink,
+                 NativeDone done, void *ctx);
+int native_run_once(NativeEngine *engine, int timeout_ms);
+#endif
+int mux_open(Options *opts);
+void mux_close(Options *opts);
+void sha256_init(Sha256 *ctx);
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_LEN]);
+int base64_decode(const char *in, size_t len, unsigned char *out);
+int blob_fingerprint(StrView blob, unsigned char fingerprint[SHA256_LEN]);
+int key_fingerprint(const char *key_content, unsigned char fingerprint[SHA256_LEN]);
+int fpset_find(const FpSet *set, const unsigned char fp[SHA256_LEN], size_t *index);
+int fpset_add(FpSet *set, const unsigned char fp[SHA256_LEN], size_t *index);
+void fpset_free(FpSet *set);
+int key_dedup(char *key_content);
+void state_id(const Options *opts, const unsigned char fingerprint[SHA256_LEN],
+              unsigned char id[SHA256_LEN]);
+int state_open(StateCache *cache);
+void state_close(StateCache *cache);
+const StateRecord *state_find(StateCache *cache, const unsigned char id[SHA256_LEN]);
+const StateRecord *state_lookup(StateCache *cache, const Options *opts,
+                                const unsigned char id[SHA256_LEN]);
+int state_store(StateCache *cache, const StateRecord *rec);
+void state_confirm(StateCache *cache, const unsigned char id[SHA256_LEN], const Buffer *out);
+void state_forget_host(StateCache *cache, const Options *opts, time_t when);
+void fpset_collect(const KeyLine *key, void *ctx);
+void keys_match(const KeyLine *key, void *ctx);
+int keys_missing(const char *key_content, FpSet *have, Buffer *payload);
+void install_script(const Options *opts, const char *key_content, const StateRecord *known,
+                    char *script, size_t size);
+void sync_diff(const char *key_content, const Buffer *out, int *added, int *removed, int *kept);
+int install_key(Options *opts, const char *key_content, const StateRecord *known, Buffer *out);
+const char *install_status_text(int status);
+int copy_key_to_server(Options *opts, const char *key_content, StateCache *cache);
+int remove_keys(Options *opts, const char *key_content, const FpSet *fingerprints, Buffer *out);
+int remove_from_server(Options *opts, const char *key_content, const FpSet *fingerprints,
+                       StateCache *cache);
+int rotate_on_server(Options *opts, const char *rotate_input, StateCache *cache);
+int check_keys(Options *opts, const char *key_content, int *missing);
+int check_on_server(Options *opts, const char *key_content);
+int target_list_add(TargetList *targets, const char *target);
+void target_list_free(TargetList *targets);
+int target_source_next(TargetSource *source, const Options *base, Options *opts);
+int run_fleet(Options *opts, TargetSource *source, const char *key_content,
+              const FpSet *fingerprints, Audit *audit, StateCache *cache);
+int audit_host(Audit *audit, const Options *opts, size_t *index);
+int audit_add(Audit *audit, size_t host, const KeyLine *key);
+void audit_sort(Audit *audit);
+void audit_write_json(const Audit *audit, FILE *fp);
+int audit_save(const Audit *audit, const char *path);
+void audit_free(Audit *audit);
+int snapshot_open(Snapshot *snap, const char *path);
+void snapshot_close(Snapshot *snap);
+int where_is(const Options *opts);
+int keys_on(const Options *opts);
+int run_audit(Options *opts, TargetSource *source);
 int test_connection(Options *opts);
 char* get_home_dir(void);
 int file_exists(const char *path);
-void trim_string(char *str);
+int is_directory(const char *path);
+void keys_init(KeyParser *parser, const char *data, size_t len);
+int keys_next(KeyParser *parser, KeyLine *key);
+StrView key_text(const KeyLine *key);
+void keystream_init(KeyStream *ks, KeyLineFn line, void *ctx);
+int keystream_feed(void *ctx, const char *data, size_t len);
+void keystream_end(KeyStream *ks);
 
 /* Get home directory */
 char* get_home_dir(void) {
     static char home[MAX_PATH_LEN];
-    const char *home_env = getenv("USERPROFILE");
+    const char *home_env = getenv(HOME_ENV);
     if (home_env) {
         strncpy(home, home_env, MAX_PATH_LEN - 1);
         home[MAX_PATH_LEN - 1] = '\0';
@@ -63,246 +652,6130 @@ int file_exists(const char *path) {
     return (stat(path, &st) == 0);
 }
 
-/* Trim leading and trailing whitespace */
-void trim_string(char *str) {
-    char *start = str;
-    char *end;
+int is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+/*
+ * authorized_keys parser.
+ * Splits a buffer into lines and each key line into
+ *   [options] type base64-blob [comment]
+ * as sshd reads it, where options is a comma-separated list whose quoted
+ * strings may contain spaces. Everything is returned as views into the
+ * buffer; nothing is copied or NUL-terminated, and the buffer is scanned
+ * once. Lines may end in LF or CRLF.
+ */
+static int is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static StrView view(const char *start, const char *end) {
+    StrView v;
+    
+    v.ptr = start;
+    v.len = (size_t)(end - start);
+    return v;
+}
+
+/* End of the field starting at p */
+static const char *field_end(const char *p, const char *end) {
+    while (p < end && !is_blank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && is_blank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+static int is_base64(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+           c == '+' || c == '/';
+}
+
+/*
+ * Scanners for the two long runs in authorized_keys: the bytes up to the
+ * next newline, and the base64 of a key blob. Each returns the first byte
+ * that does not belong (or `end`). The SSE2 and AVX2 versions test 16 or
+ * 32 bytes per step; which one runs is decided once, from the CPU.
+ */
+typedef struct {
+    const char *name;
+    const char *(*newline)(const char *p, const char *end);
+    const char *(*base64)(const char *p, const char *end);
+} Scanner;
+
+static const char *scan_newline_scalar(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    
+    return nl ? nl : end;
+}
+
+static const char *scan_base64_scalar(const char *p, const char *end) {
+    while (p < end && is_base64(*p)) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef HAVE_SCAN_SIMD
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static unsigned lowest_bit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long bit;
+    
+    _BitScanForward(&bit, mask);
+    return (unsigned)bit;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+/*
+ * x - lo + 0x80 is below 0x80 + n (as a signed byte) exactly when x is in
+ * [lo, lo + n), which turns each character range into one compare.
+ */
+#define IN_RANGE_SSE2(x, lo, n) \
+    _mm_cmpgt_epi8(_mm_set1_epi8((char)(0x80 + (n))), \
+                   _mm_add_epi8((x), _mm_set1_epi8((char)(0x80 - (lo)))))
+#define IN_RANGE_AVX2(x, lo, n) \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + (n))), \
+                      _mm256_add_epi8((x), _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+/* Bit i set for each of the 16 bytes at p that is (or is not) of the kind */
+static unsigned newline_mask_sse2(const char *p) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+}
+
+static unsigned non_base64_mask_sse2(const char *p) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i ok = _mm_or_si128(
+        _mm_or_si128(IN_RANGE_SSE2(x, 'A', 26), IN_RANGE_SSE2(x, 'a', 26)),
+        _mm_or_si128(IN_RANGE_SSE2(x, '0', 10),
+                     _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('+')),
+                                  _mm_cmpeq_epi8(x, _mm_set1_epi8('/')))));
+    
+    return ~(unsigned)_mm_movemask_epi8(ok) & 0xFFFF;
+}
+
+/*
+ * Test `width` bytes at a time. Runs shorter than one block go to the
+ * scalar loop; otherwise the tail is covered by re-testing the last full
+ * block and dropping the bits already seen.
+ */
+#define SCAN_BLOCKS(p, end, width, block_mask, fallback) do { \
+    const char *start_ = (p); \
+    unsigned mask_; \
+    \
+    if ((end) - (p) < (width)) { \
+        return fallback((p), (end)); \
+    } \
+    for (; (end) - (p) >= (width); (p) += (width)) { \
+        if ((mask_ = block_mask(p)) != 0) { \
+            return (p) + lowest_bit(mask_); \
+        } \
+    } \
+    if ((p) > start_ && (p) < (end)) { \
+        mask_ = block_mask((end) - (width)) >> ((width) - ((end) - (p))); \
+        if (mask_) { \
+            return (p) + lowest_bit(mask_); \
+        } \
+    } \
+    return (end); \
+} while (0)
+
+static const char *scan_newline_sse2(const char *p, const char *end) {
+    SCAN_BLOCKS(p, end, 16, newline_mask_sse2, scan_newline_scalar);
+}
+
+static const char *scan_base64_sse2(const char *p, const char *end) {
+    SCAN_BLOCKS(p, end, 16, non_base64_mask_sse2, scan_base64_scalar);
+}
+
+static const Scanner scanner_sse2 = { "sse2", scan_newline_sse2, scan_base64_sse2 };
+
+TARGET_AVX2 static unsigned newline_mask_avx2(const char *p) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    
+    return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+}
+
+TARGET_AVX2 static unsigned non_base64_mask_avx2(const char *p) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ok = _mm256_or_si256(
+        _mm256_or_si256(IN_RANGE_AVX2(x, 'A', 26), IN_RANGE_AVX2(x, 'a', 26)),
+        _mm256_or_si256(IN_RANGE_AVX2(x, '0', 10),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('+')),
+                                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')))));
+    
+    return ~(unsigned)_mm256_movemask_epi8(ok);
+}
+
+/* Short runs drop to SSE2 before any 256-bit register is touched */
+TARGET_AVX2 static const char *scan_newline_avx2(const char *p, const char *end) {
+    SCAN_BLOCKS(p, end, 32, newline_mask_avx2, scan_newline_sse2);
+}
+
+TARGET_AVX2 static const char *scan_base64_avx2(const char *p, const char *end) {
+    SCAN_BLOCKS(p, end, 32, non_base64_mask_avx2, scan_base64_sse2);
+}
+
+static const Scanner scanner_avx2 = { "avx2", scan_newline_avx2, scan_base64_avx2 };
+
+static int cpu_has_avx2(void) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return 0;
+    }
+    /* The OS must also save the YMM registers (OSXSAVE, XCR0 bits 1-2) */
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) {
+        return 0;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+#else
+static const Scanner scanner_scalar = { "scalar", scan_newline_scalar, scan_base64_scalar };
+#endif
+
+static const Scanner *scanner;
+
+static const Scanner *scanner_get(void) {
+    if (!scanner) {
+#ifdef HAVE_SCAN_SIMD
+        scanner = cpu_has_avx2() ? &scanner_avx2 : &scanner_sse2;
+#else
+        scanner = &scanner_scalar;
+#endif
+    }
+    return scanner;
+}
+
+static const char *scan_newline(const char *p, const char *end) {
+    return scanner_get()->newline(p, end);
+}
+
+static const char *scan_base64(const char *p, const char *end) {
+    return scanner_get()->base64(p, end);
+}
+
+/* ssh-ed25519, ecdsa-sha2-nistp256, sk-ssh-ed25519@openssh.com, ... */
+static int key_type_ok(const char *p, const char *end) {
+    if (p == end) {
+        return 0;
+    }
+    for (; p < end; p++) {
+        if (!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z') &&
+            !(*p >= '0' && *p <= '9') && !strchr("@.-_+", *p)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * End of the blob field starting at p, or NULL if it is not one. Every
+ * OpenSSH blob starts with the 4-byte length of the key type name, which
+ * always encodes as "AAAA"; options and comments never do.
+ */
+static const char *blob_end(const char *p, const char *end) {
+    const char *q;
     size_t len;
     
-    while (*start && (*start == ' ' || *start == '\t' || *start == '\n' || *start == '\r')) {
-        start++;
+    if (end - p < 4 || memcmp(p, "AAAA", 4) != 0) {
+        return NULL;
+    }
+    q = scan_base64(p + 4, end);
+    /* Up to two padding characters at the very end */
+    if (q < end && *q == '=' && (++q < end && *q == '=')) {
+        q++;
     }
+    len = (size_t)(q - p);
+    if (len <= 4 || len % 4 != 0 || (q < end && !is_blank(*q))) {
+        return NULL;
+    }
+    return q;
+}
+
+/* End of an options field: the first blank outside quotes, NULL if unterminated */
+static const char *options_end(const char *p, const char *end) {
+    int quoted = 0;
     
-    if (*start == '\0') {
-        str[0] = '\0';
-        return;
+    for (; p < end; p++) {
+        if (quoted && *p == '\\' && p + 1 < end && p[1] == '"') {
+            p++;
+        } else if (*p == '"') {
+            quoted = !quoted;
+        } else if (!quoted && is_blank(*p)) {
+            break;
+        }
+    }
+    return quoted ? NULL : p;
+}
+
+/* Is cert-authority one of the options? */
+static int options_cert_authority(StrView options) {
+    static const char flag[] = "cert-authority";
+    const char *p = options.ptr;
+    const char *end = options.ptr + options.len;
+    const char *start = p;
+    int quoted = 0;
+    size_t i;
+    
+    for (;; p++) {
+        if (p == end || (!quoted && *p == ',')) {
+            if ((size_t)(p - start) == sizeof(flag) - 1) {
+                for (i = 0; i < sizeof(flag) - 1 && (start[i] | 0x20) == flag[i]; i++) {
+                }
+                if (i == sizeof(flag) - 1) {
+                    return 1;
+                }
+            }
+            if (p == end) {
+                return 0;
+            }
+            start = p + 1;
+        } else if (quoted && *p == '\\' && p + 1 < end) {
+            p++;
+        } else if (*p == '"') {
+            quoted = !quoted;
+        }
     }
+}
+
+/* Split "type blob [comment]" at p; -1 if it is not one */
+static int key_fields(const char *p, const char *end, KeyLine *key) {
+    const char *next = field_end(p, end);
     
-    len = strlen(start);
-    end = start + len - 1;
+    if (!key_type_ok(p, next)) {
+        return -1;
+    }
+    key->type = view(p, next);
+    p = skip_blanks(next, end);
+    next = blob_end(p, end);
+    if (!next) {
+        return -1;
+    }
+    key->blob = view(p, next);
+    p = skip_blanks(next, end);
+    while (end > p && is_blank(end[-1])) {
+        end--;
+    }
+    key->comment = view(p, end);
+    return 0;
+}
+
+void keys_init(KeyParser *parser, const char *data, size_t len) {
+    parser->pos = data;
+    parser->end = data + len;
+    parser->line_no = 0;
+}
+
+/*
+ * Parse the next line into `key`. Returns 0 at the end of the buffer.
+ * Blank, comment and unparsable lines are returned too, with kind set
+ * accordingly and only `line` filled in, so rewrites can keep them.
+ */
+int keys_next(KeyParser *parser, KeyLine *key) {
+    const char *p = parser->pos;
+    const char *end;
+    const char *opts;
     
-    while (end > start && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
+    if (p >= parser->end) {
+        return 0;
+    }
+    end = scan_newline(p, parser->end);
+    parser->pos = end < parser->end ? end + 1 : end;
+    if (end > p && end[-1] == '\r') {
         end--;
     }
-    *(end + 1) = '\0';
     
-    if (start != str) {
-        memmove(str, start, strlen(start) + 1);
+    memset(key, 0, sizeof(*key));
+    key->line = view(p, end);
+    key->line_no = ++parser->line_no;
+    p = skip_blanks(p, end);
+    if (p == end) {
+        key->kind = KEYLINE_BLANK;
+    } else if (*p == '#') {
+        key->kind = KEYLINE_COMMENT;
+    } else if (key_fields(p, end, key) == 0) {
+        key->kind = KEYLINE_KEY;
+    } else if ((opts = options_end(p, end)) != NULL &&
+               key_fields(skip_blanks(opts, end), end, key) == 0) {
+        key->kind = KEYLINE_KEY;
+        key->options = view(p, opts);
+        key->cert_authority = options_cert_authority(key->options);
+    } else {
+        key->kind = KEYLINE_INVALID;
+        key->type = key->blob = key->comment = view(end, end);
     }
+    return 1;
 }
 
-/* Print help message */
-void print_help(const char *prog_name) {
-    printf("Usage: %s [options] [user@]host\n\n", prog_name);
-    printf("Copy your public SSH key to a remote server\n\n");
-    printf("Options:\n");
-    printf("  -i, --identity_file <file>   Use this public key (default: ~/.ssh/id_rsa.pub)\n");
-    printf("  -p, --port <port>            SSH port (default: 22)\n");
-    printf("  -f, --force                  Don't check for existing keys\n");
-    printf("  -n, --dry_run                Show what would be done, but don't execute\n");
-    printf("  -q, --quiet                  Quiet mode\n");
-    printf("  -o, --ssh_options <options>  Additional SSH options\n");
-    printf("  -F, --ssh_config <file>      SSH configuration file\n");
-    printf("  -h, --help                   Show this help message\n\n");
-    printf("Examples:\n");
-    printf("  %s user@example.com\n", prog_name);
-    printf("  %s -i ~/.ssh/id_ed25519.pub user@192.168.1.100\n", prog_name);
-    printf("  %s -p 2222 -f root@server.local\n", prog_name);
+/* The key line from its options or type to its last non-blank character */
+StrView key_text(const KeyLine *key) {
+    const char *start = key->options.len ? key->options.ptr : key->type.ptr;
+    const char *end = key->comment.len ? key->comment.ptr + key->comment.len
+                                       : key->blob.ptr + key->blob.len;
+    
+    return view(start, end);
 }
 
-/* Parse target string user@host */
-int parse_target(const char *target, Options *opts) {
-    const char *at_sign = strchr(target, '@');
+/* Parse complete lines and hand them to the stream's callback */
+static void keystream_parse(KeyStream *ks, const char *data, size_t len) {
+    KeyParser parser;
+    KeyLine key;
     
-    if (at_sign) {
-        size_t user_len = at_sign - target;
-        if (user_len >= sizeof(opts->user)) {
-            user_len = sizeof(opts->user) - 1;
+    keys_init(&parser, data, len);
+    parser.line_no = ks->line_no;
+    while (keys_next(&parser, &key)) {
+        ks->line(&key, ks->ctx);
+    }
+    ks->line_no = parser.line_no;
+}
+
+void keystream_init(KeyStream *ks, KeyLineFn line, void *ctx) {
+    memset(ks, 0, sizeof(*ks));
+    ks->line = line;
+    ks->ctx = ctx;
+}
+
+/*
+ * Take the next chunk of the stream (a BufferSink). Complete lines are
+ * parsed where they lie; only a line split across chunks is copied, so
+ * memory is bounded by the longest line, not by the file.
+ */
+int keystream_feed(void *ctx, const char *data, size_t len) {
+    KeyStream *ks = ctx;
+    size_t head;
+    size_t tail = len;
+    
+    while (tail > 0 && data[tail - 1] != '\n') {
+        tail--;
+    }
+    if (tail == 0) {
+        return buffer_append(&ks->carry, data, len);
+    }
+    if (ks->carry.len > 0) {
+        head = (size_t)((const char *)memchr(data, '\n', len) - data) + 1;
+        if (buffer_append(&ks->carry, data, head) != 0) {
+            return -1;
         }
-        strncpy(opts->user, target, user_len);
-        opts->user[user_len] = '\0';
-        strncpy(opts->host, at_sign + 1, sizeof(opts->host) - 1);
-        opts->host[sizeof(opts->host) - 1] = '\0';
-    } else {
-        const char *username = getenv("USERNAME");
-        if (username) {
-            strncpy(opts->user, username, sizeof(opts->user) - 1);
-            opts->user[sizeof(opts->user) - 1] = '\0';
-        } else {
-            strcpy(opts->user, "user");
+        keystream_parse(ks, ks->carry.data, ks->carry.len);
+        ks->carry.len = 0;
+        data += head;
+        len -= head;
+        tail -= head;
+    }
+    keystream_parse(ks, data, tail);
+    return buffer_append(&ks->carry, data + tail, len - tail);
+}
+
+/* The stream has ended: parse a last line without a newline */
+void keystream_end(KeyStream *ks) {
+    if (ks->carry.len > 0) {
+        keystream_parse(ks, ks->carry.data, ks->carry.len);
+    }
+    buffer_free(&ks->carry);
+}
+
+/* SHA-256 (FIPS 180-4) */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *ctx, const unsigned char *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+    
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + (ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+    a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+    e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+             sha256_k[i] + w[i];
+        t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    
+    memcpy(ctx->h, h0, sizeof(h0));
+    ctx->bits = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t n;
+    
+    ctx->bits += (uint64_t)len * 8;
+    while (len > 0) {
+        if (ctx->used == 0 && len >= 64) {
+            sha256_block(ctx, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+        n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used == 64) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_LEN]) {
+    uint64_t bits = ctx->bits;
+    int i;
+    
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (i = 0; i < 8; i++) {
+        ctx->block[63 - i] = (unsigned char)(bits >> (i * 8));
+    }
+    sha256_block(ctx, ctx->block);
+    for (i = 0; i < 32; i++) {
+        digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+/*
+ * Decode padded base64 into `out`, which must hold len / 4 * 3 bytes.
+ * Returns the decoded length, or -1 if `in` is not valid base64.
+ */
+int base64_decode(const char *in, size_t len, unsigned char *out) {
+    static signed char value[256];
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned long quantum;
+    size_t i;
+    int n = 0;
+    int pad;
+    int j;
+    
+    if (value['A'] == 0) {
+        memset(value, -1, sizeof(value));
+        for (j = 0; j < 64; j++) {
+            value[(unsigned char)alphabet[j]] = (signed char)j;
+        }
+    }
+    if (len % 4 != 0) {
+        return -1;
+    }
+    for (i = 0; i < len; i += 4) {
+        quantum = 0;
+        pad = 0;
+        for (j = 0; j < 4; j++) {
+            unsigned char c = (unsigned char)in[i + j];
+            if (c == '=' && i + 4 == len && j >= 2) {
+                pad++;
+                quantum <<= 6;
+            } else if (value[c] < 0 || pad) {
+                return -1;
+            } else {
+                quantum = quantum << 6 | (unsigned long)value[c];
+            }
+        }
+        out[n++] = (unsigned char)(quantum >> 16);
+        if (pad < 2) {
+            out[n++] = (unsigned char)(quantum >> 8);
+        }
+        if (pad < 1) {
+            out[n++] = (unsigned char)quantum;
+        }
+    }
+    return n;
+}
+
+/* SHA-256 of a decoded key blob, as in ssh-keygen -l -E sha256 */
+int blob_fingerprint(StrView blob, unsigned char fingerprint[SHA256_LEN]) {
+    unsigned char chunk[768];
+    const char *p = blob.ptr;
+    size_t len = blob.len;
+    size_t step;
+    Sha256 ctx;
+    int n;
+    
+    /* Decode a whole number of quanta at a time; only the last may be padded */
+    sha256_init(&ctx);
+    while (len > 0) {
+        step = len > 1024 ? 1024 : len;
+        n = base64_decode(p, step, chunk);
+        if (n < 0) {
+            return -1;
+        }
+        sha256_update(&ctx, chunk, (size_t)n);
+        p += step;
+        len -= step;
+    }
+    sha256_final(&ctx, fingerprint);
+    return 0;
+}
+
+static int fingerprint_cmp(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_LEN);
+}
+
+/*
+ * Fingerprint of the keys in key_content: that of the key itself if there
+ * is just one, else SHA-256 over the sorted fingerprints of all of them,
+ * so the same set in any order gives the same value. -1 if it holds none.
+ */
+int key_fingerprint(const char *key_content, unsigned char fingerprint[SHA256_LEN]) {
+    unsigned char one[SHA256_LEN];
+    KeyParser parser;
+    KeyLine key;
+    FpSet set;
+    Sha256 ctx;
+    int result = 0;
+    
+    memset(&set, 0, sizeof(set));
+    keys_init(&parser, key_content, strlen(key_content));
+    while (result == 0 && keys_next(&parser, &key)) {
+        if (key.kind == KEYLINE_KEY && (blob_fingerprint(key.blob, one) != 0 ||
+                                        fpset_add(&set, one, NULL) < 0)) {
+            result = -1;
+        }
+    }
+    if (result == 0 && set.count == 0) {
+        result = -1;
+    } else if (result == 0 && set.count == 1) {
+        memcpy(fingerprint, set.items[0], SHA256_LEN);
+    } else if (result == 0) {
+        /* The slots go stale here, but the set is only freed afterwards */
+        qsort(set.items, set.count, SHA256_LEN, fingerprint_cmp);
+        sha256_init(&ctx);
+        sha256_update(&ctx, set.items[0], set.count * SHA256_LEN);
+        sha256_final(&ctx, fingerprint);
+    }
+    fpset_free(&set);
+    return result;
+}
+
+/* Digests are uniformly distributed already, so any bytes will do as hash */
+static size_t fpset_hash(const unsigned char *fp) {
+    size_t hash;
+    
+    memcpy(&hash, fp, sizeof(hash));
+    return hash;
+}
+
+/* Is `fp` in the set? If so, its index goes to `index` (may be NULL) */
+int fpset_find(const FpSet *set, const unsigned char fp[SHA256_LEN], size_t *index) {
+    size_t mask = set->slot_count - 1;
+    size_t i;
+    size_t n;
+    
+    if (set->slot_count == 0) {
+        return 0;
+    }
+    for (i = fpset_hash(fp) & mask; (n = set->slots[i]) != 0; i = (i + 1) & mask) {
+        if (memcmp(set->items[n - 1], fp, SHA256_LEN) == 0) {
+            if (index) {
+                *index = n - 1;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Add `fp` unless it is there already. Returns 1 if it was added, 0 if it
+ * was present and -1 if out of memory; `index` (may be NULL) gets its index.
+ */
+int fpset_add(FpSet *set, const unsigned char fp[SHA256_LEN], size_t *index) {
+    unsigned char (*items)[SHA256_LEN];
+    size_t *slots;
+    size_t count;
+    size_t i;
+    size_t n;
+    
+    if (fpset_find(set, fp, index)) {
+        return 0;
+    }
+    /* Open addressing with linear probing, kept at most half full */
+    if ((set->count + 1) * 2 > set->slot_count) {
+        count = set->slot_count ? set->slot_count * 2 : 64;
+        slots = calloc(count, sizeof(size_t));
+        if (!slots) {
+            return -1;
+        }
+        for (n = 0; n < set->count; n++) {
+            for (i = fpset_hash(set->items[n]) & (count - 1); slots[i]; i = (i + 1) & (count - 1)) {
+            }
+            slots[i] = n + 1;
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->slot_count = count;
+    }
+    if (set->count == set->capacity) {
+        count = set->capacity ? set->capacity * 2 : 32;
+        items = realloc(set->items, count * SHA256_LEN);
+        if (!items) {
+            return -1;
+        }
+        set->items = items;
+        set->capacity = count;
+    }
+    
+    memcpy(set->items[set->count], fp, SHA256_LEN);
+    for (i = fpset_hash(fp) & (set->slot_count - 1); set->slots[i];
+         i = (i + 1) & (set->slot_count - 1)) {
+    }
+    set->slots[i] = ++set->count;
+    if (index) {
+        *index = set->count - 1;
+    }
+    return 1;
+}
+
+void fpset_free(FpSet *set) {
+    free(set->items);
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Keep the first line of every distinct key in key_content, in place, and
+ * drop lines that hold no key. Keys are told apart by fingerprint, so the
+ * same key with another comment or options is a duplicate while a key
+ * that merely contains another as a substring is not. Returns the number
+ * of keys left.
+ */
+int key_dedup(char *key_content) {
+    unsigned char fingerprint[SHA256_LEN];
+    KeyParser parser;
+    KeyLine key;
+    StrView text;
+    FpSet seen;
+    char *out = key_content;
+    int keys = 0;
+    
+    memset(&seen, 0, sizeof(seen));
+    keys_init(&parser, key_content, strlen(key_content));
+    /* The output never overtakes the parser, so this can run in place */
+    while (keys_next(&parser, &key)) {
+        /* Out of memory only costs the local dedup; the server checks again */
+        if (key.kind != KEYLINE_KEY || blob_fingerprint(key.blob, fingerprint) != 0 ||
+            fpset_add(&seen, fingerprint, NULL) == 0) {
+            continue;
+        }
+        text = key_text(&key);
+        if (out != key_content) {
+            *out++ = '\n';
+        }
+        memmove(out, text.ptr, text.len);
+        out += text.len;
+        keys++;
+    }
+    *out = '\0';
+    fpset_free(&seen);
+    return keys;
+}
+
+/* Print help message */
+void print_help(const char *prog_name) {
+    printf("Usage: %s [options] [user@]host[:port]...\n\n", prog_name);
+    printf("Copy your public SSH key to a remote server\n\n");
+    printf("Options:\n");
+    printf("  -i, --identity_file <file>   Public key, key bundle or directory of .pub files\n");
+    printf("                               (default: ~/.ssh/id_rsa.pub);\n");
+    printf("                               repeat to install several keys at once\n");
+    printf("  -p, --port <port>            SSH port (default: 22)\n");
+    printf("  -f, --force                  Don't check for existing keys\n");
+    printf("  -n, --dry_run                Show what would be done, but don't execute\n");
+    printf("  -q, --quiet                  Quiet mode\n");
+    printf("  -o, --ssh_options <options>  Additional SSH options\n");
+    printf("  -F, --ssh_config <file>      SSH configuration file\n");
+    printf("      --no_mux                 Don't share one connection between ssh calls\n");
+    printf("      --no_cache               Contact hosts the state cache says have the key\n");
+    printf("      --sync <keys>            Make the managed keys on each host exactly <keys>\n");
+    printf("                               (key, bundle or directory), removing others\n");
+    printf("      --remove <key>           Remove a key (file, bundle, directory or SHA256:\n");
+    printf("                               fingerprint) from each host; may be repeated\n");
+    printf("      --rotate <old> <new>     Replace the old keys with the new ones on each host\n");
+    printf("                               in one step (-i adds more new keys)\n");
+    printf("      --audit                  Read authorized_keys from each host and print which\n");
+    printf("                               keys are trusted where, as JSON\n");
+    printf("      --audit_file <file>      Where --audit saves its index\n");
+    printf("                               (default: ~/.ssh/ssh-copy-id.audit)\n");
+    printf("      --check                  Only report whether each host has the key; reads,\n");
+    printf("                               never writes, never asks for a password\n");
+    printf("      --timings <table|json>   Print how long each phase took (per host\n");
+    printf("                               percentiles in fleet mode) to stderr\n");
+    printf("      --where_is <SHA256:fp>   List the hosts and lines trusting a key, from the\n");
+    printf("                               saved audit (no connection is made)\n");
+    printf("      --keys_on <target>       List the keys [user@]host[:port] trusts, from the\n");
+    printf("                               saved audit (no connection is made)\n");
+    printf("  -H, --hosts_file <file>      Also copy to every host listed in file, one\n");
+    printf("                               \"[user@]host[:port] [key [ssh_config]]\" per line\n");
+    printf("  -j, --jobs <n>               Hosts processed in parallel (default: %d)\n", DEFAULT_JOBS);
+    printf("  -h, --help                   Show this help message\n\n");
+    printf("Examples:\n");
+    printf("  %s user@example.com\n", prog_name);
+    printf("  %s -i ~/.ssh/id_ed25519.pub user@192.168.1.100\n", prog_name);
+    printf("  %s -i laptop.pub -i yubikey.pub -i ci.pub deploy@server\n", prog_name);
+    printf("  %s -p 2222 -f root@server.local\n", prog_name);
+    printf("  %s -j 50 -H hosts.txt\n", prog_name);
+    printf("  %s --sync team_keys/ -H hosts.txt\n", prog_name);
+    printf("  %s --remove alice.pub --remove SHA256:<fingerprint> -H hosts.txt\n", prog_name);
+    printf("  %s --rotate old_id.pub new_id.pub -H hosts.txt\n", prog_name);
+    printf("  %s --audit -j 200 -H hosts.txt > audit.json\n", prog_name);
+}
+
+/* Parse target string [user@]host[:port] (IPv6 as [addr]:port) */
+int parse_target(const char *target, Options *opts) {
+    const char *at_sign = strchr(target, '@');
+    const char *host = target;
+    const char *port = NULL;
+    size_t host_len;
+    
+    if (at_sign) {
+        size_t user_len = at_sign - target;
+        if (user_len >= sizeof(opts->user)) {
+            user_len = sizeof(opts->user) - 1;
+        }
+        strncpy(opts->user, target, user_len);
+        opts->user[user_len] = '\0';
+        host = at_sign + 1;
+    } else {
+        const char *username = getenv(USER_ENV);
+        if (username) {
+            strncpy(opts->user, username, sizeof(opts->user) - 1);
+            opts->user[sizeof(opts->user) - 1] = '\0';
+        } else {
+            strcpy(opts->user, "user");
+        }
+    }
+    
+    host_len = strlen(host);
+    if (host[0] == '[') {
+        const char *close = strchr(host, ']');
+        if (!close) {
+            return -1;
+        }
+        if (close[1] == ':') {
+            port = close + 2;
+        } else if (close[1] != '\0') {
+            return -1;
+        }
+        host++;
+        host_len = close - host;
+    } else {
+        const char *colon = strchr(host, ':');
+        /* A bare IPv6 address has several colons and no port */
+        if (colon && !strchr(colon + 1, ':')) {
+            port = colon + 1;
+            host_len = colon - host;
+        }
+    }
+    
+    if (host_len == 0) {
+        return -1;
+    }
+    if (host_len >= sizeof(opts->host)) {
+        host_len = sizeof(opts->host) - 1;
+    }
+    memcpy(opts->host, host, host_len);
+    opts->host[host_len] = '\0';
+    
+    if (port) {
+        char *end;
+        long value = strtol(port, &end, 10);
+        if (*port == '\0' || *end != '\0' || value < 1 || value > 65535) {
+            return -1;
+        }
+        opts->port = (int)value;
+    }
+    
+    return 0;
+}
+
+/* Replace a leading ~ in path with the home directory */
+static void expand_home(char *path, size_t path_size) {
+    char *home_dir = get_home_dir();
+    char full_path[MAX_PATH_LEN];
+    size_t len;
+    
+    if (path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir ? home_dir : "", path + 1);
+        len = strlen(full_path);
+        if (len >= path_size) {
+            len = path_size - 1;
+        }
+        memcpy(path, full_path, len);
+        path[len] = '\0';
+    }
+}
+
+/*
+ * Public key file for an -i argument; the default key if it is empty.
+ * A private key name gets ".pub" added unless only the name itself
+ * exists, which makes it a bundle of keys (or a directory of them).
+ */
+int identity_key_path(const char *identity_file, char *key_path, size_t key_path_size) {
+    char *home_dir = get_home_dir();
+    char given[MAX_PATH_LEN];
+    
+    if (identity_file[0] != '\0') {
+        strncpy(key_path, identity_file, key_path_size - 1);
+        key_path[key_path_size - 1] = '\0';
+        expand_home(key_path, key_path_size);
+        if (!strstr(key_path, ".pub")) {
+            snprintf(given, sizeof(given), "%s", key_path);
+            strncat(key_path, ".pub", key_path_size - strlen(key_path) - 1);
+            if (!file_exists(key_path) && file_exists(given)) {
+                snprintf(key_path, key_path_size, "%s", given);
+            }
+        }
+    } else {
+        snprintf(key_path, key_path_size, "%s" PATH_SEP ".ssh" PATH_SEP "id_rsa.pub", home_dir ? home_dir : ".");
+    }
+    expand_home(key_path, key_path_size);
+    return 0;
+}
+
+/* Get public key file path */
+int get_public_key_path(Options *opts, char *key_path, size_t key_path_size) {
+    if (opts->key_file[0] != '\0') {
+        snprintf(key_path, key_path_size, "%s", opts->key_file);
+        expand_home(key_path, key_path_size);
+        return 0;
+    }
+    return identity_key_path(opts->identity_file, key_path, key_path_size);
+}
+
+static int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Paths of the *.pub files in dir, sorted; -1 if it cannot be read */
+static int list_public_keys(const char *dir, TargetList *paths) {
+    char path[MAX_PATH_LEN];
+    const char *name;
+    size_t len;
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    HANDLE find;
+    
+    snprintf(path, sizeof(path), "%s" PATH_SEP "*.pub", dir);
+    find = FindFirstFileA(path, &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+    }
+    do {
+        name = entry.cFileName;
+#else
+    struct dirent *entry;
+    DIR *find = opendir(dir);
+    
+    if (!find) {
+        return -1;
+    }
+    while ((entry = readdir(find)) != NULL) {
+        name = entry->d_name;
+#endif
+        /* The pattern also matches 8.3 aliases, so check the real name */
+        len = strlen(name);
+        if (name[0] != '.' && len > 4 && strcmp(name + len - 4, ".pub") == 0) {
+            snprintf(path, sizeof(path), "%s" PATH_SEP "%s", dir, name);
+            if (!is_directory(path) && target_list_add(paths, path) != 0) {
+                break;
+            }
+        }
+#ifdef _WIN32
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    }
+    closedir(find);
+#endif
+    qsort(paths->items, paths->count, sizeof(char *), path_cmp);
+    return 0;
+}
+
+/*
+ * Append the public keys in key_path to `keys`: one key, a bundle of them
+ * one per line, or a directory whose *.pub files are read in name order.
+ * There is no size limit. Returns -1 if nothing could be read.
+ */
+int read_public_key(const char *key_path, Buffer *keys) {
+    char chunk[16384];
+    TargetList paths = { NULL, 0, 0 };
+    size_t start = keys->len;
+    size_t n;
+    size_t i;
+    FILE *fp;
+    
+    if (is_directory(key_path)) {
+        if (list_public_keys(key_path, &paths) != 0) {
+            return -1;
+        }
+        for (i = 0; i < paths.count; i++) {
+            if (read_public_key(paths.items[i], keys) != 0) {
+                fprintf(stderr, "Skipping unreadable key file: %s\n", paths.items[i]);
+            }
+        }
+        target_list_free(&paths);
+        return keys->len > start ? 0 : -1;
+    }
+    
+    fp = fopen(key_path, "r");
+    if (!fp) {
+        return -1;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (buffer_append(keys, chunk, n) != 0) {
+            break;
+        }
+    }
+    fclose(fp);
+    
+    if (keys->len == start) {
+        return -1;
+    }
+    /* Keep the next file's first line apart from this one's last */
+    if (keys->data[keys->len - 1] != '\n' && buffer_append(keys, "\n", 1) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the public keys of every -i argument (the default key if none was
+ * given) into `keys` as one set, each distinct key once. Problems are
+ * reported here. Returns the number of keys, -1 on error.
+ */
+int load_public_keys(const TargetList *key_files, Buffer *keys) {
+    char key_path[MAX_PATH_LEN];
+    char private_key[MAX_PATH_LEN];
+    unsigned char fingerprint[SHA256_LEN];
+    size_t start;
+    size_t i = 0;
+    char *pub_pos;
+    
+    do {
+        identity_key_path(key_files->count ? key_files->items[i] : "", key_path, sizeof(key_path));
+        start = keys->len;
+        if (read_public_key(key_path, keys) != 0) {
+            if (is_directory(key_path)) {
+                fprintf(stderr, "No public keys in directory: %s\n", key_path);
+                return -1;
+            }
+            fprintf(stderr, "Public key not found: %s\n", key_path);
+            
+            strncpy(private_key, key_path, sizeof(private_key) - 1);
+            private_key[sizeof(private_key) - 1] = '\0';
+            pub_pos = strstr(private_key, ".pub");
+            if (pub_pos) {
+                *pub_pos = '\0';
+            }
+            
+            if (file_exists(private_key)) {
+                fprintf(stderr, "Private key found: %s\n", private_key);
+                fprintf(stderr, "Generate public key: ssh-keygen -y -f %s > %s\n", 
+                        private_key, key_path);
+            }
+            return -1;
+        }
+        if (key_fingerprint(keys->data + start, fingerprint) != 0) {
+            fprintf(stderr, "Not an OpenSSH public key: %s\n", key_path);
+            if (strncmp(keys->data + start, "-----BEGIN", 10) == 0) {
+                fprintf(stderr, "This is a private key, generate the public one: "
+                        "ssh-keygen -y -f %s > %s.pub\n", key_path, key_path);
+            }
+            return -1;
+        }
+    } while (++i < key_files->count);
+    
+    /* The same key may come from more than one file */
+    i = (size_t)key_dedup(keys->data);
+    keys->len = strlen(keys->data);
+    return (int)i;
+}
+
+/* A fingerprint as ssh-keygen -l prints it: "SHA256:" and unpadded base64 */
+int parse_fingerprint(const char *text, unsigned char fingerprint[SHA256_LEN]) {
+    unsigned char raw[SHA256_LEN + 3];
+    char padded[48];
+    
+    if (strncmp(text, "SHA256:", 7) != 0 || strlen(text + 7) != 43) {
+        return -1;
+    }
+    snprintf(padded, sizeof(padded), "%s=", text + 7);
+    if (base64_decode(padded, 44, raw) != SHA256_LEN) {
+        return -1;
+    }
+    memcpy(fingerprint, raw, SHA256_LEN);
+    return 0;
+}
+
+/* `fingerprint` as ssh-keygen -l prints it */
+void fingerprint_text(const unsigned char fingerprint[SHA256_LEN], char text[FINGERPRINT_TEXT_LEN]) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned long quantum;
+    char *out = text + 7;
+    size_t i;
+    
+    memcpy(text, "SHA256:", 7);
+    for (i = 0; i < SHA256_LEN; i += 3) {
+        quantum = (unsigned long)fingerprint[i] << 16;
+        if (i + 1 < SHA256_LEN) {
+            quantum |= (unsigned long)fingerprint[i + 1] << 8;
+        }
+        if (i + 2 < SHA256_LEN) {
+            quantum |= fingerprint[i + 2];
+        }
+        *out++ = alphabet[quantum >> 18 & 63];
+        *out++ = alphabet[quantum >> 12 & 63];
+        if (i + 1 < SHA256_LEN) {
+            *out++ = alphabet[quantum >> 6 & 63];
+        }
+        if (i + 2 < SHA256_LEN) {
+            *out++ = alphabet[quantum & 63];
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * The --remove arguments: fingerprints go to `fingerprints`, the rest are
+ * read as by load_public_keys() into `keys`, which stays empty (but not
+ * NULL) if there are none. Returns the number of keys and fingerprints,
+ * -1 on error.
+ */
+int load_removals(const TargetList *key_files, Buffer *keys, FpSet *fingerprints) {
+    unsigned char fingerprint[SHA256_LEN];
+    TargetList files = { NULL, 0, 0 };
+    size_t i;
+    int count = 0;
+    
+    for (i = 0; i < key_files->count && count == 0; i++) {
+        if (parse_fingerprint(key_files->items[i], fingerprint) == 0) {
+            if (fpset_add(fingerprints, fingerprint, NULL) < 0) {
+                fprintf(stderr, "Out of memory\n");
+                count = -1;
+            }
+        } else if (strncmp(key_files->items[i], "SHA256:", 7) == 0) {
+            fprintf(stderr, "Not a SHA256 fingerprint: %s\n", key_files->items[i]);
+            count = -1;
+        } else if (target_list_add(&files, key_files->items[i]) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            count = -1;
+        }
+    }
+    if (count == 0 && files.count > 0) {
+        count = load_public_keys(&files, keys);
+    }
+    target_list_free(&files);
+    if (count < 0 || buffer_append(keys, "", 0) != 0) {
+        return -1;
+    }
+    return count + (int)fingerprints->count;
+}
+
+/*
+ * The stdin of the --rotate script: the keys in old_path, ROTATE_MARKER,
+ * then the new keys of key_files. Returns the number of new keys, -1 on
+ * error.
+ */
+int load_rotation(const char *old_path, const TargetList *key_files, Buffer *input) {
+    char *items[1];
+    TargetList old_files = { items, 1, 1 };
+    Buffer new_keys = { NULL, 0, 0, NULL, NULL };
+    int count;
+    
+    items[0] = (char *)old_path;
+    count = load_public_keys(&old_files, input);
+    if (count >= 0) {
+        count = load_public_keys(key_files, &new_keys);
+    }
+    /* key_dedup() leaves no newline after the last key */
+    if (count >= 0 && (buffer_append(input, "\n" ROTATE_MARKER "\n", sizeof(ROTATE_MARKER) + 1) != 0 ||
+                       buffer_append(input, new_keys.data, new_keys.len) != 0)) {
+        count = -1;
+    }
+    buffer_free(&new_keys);
+    return count;
+}
+
+/*
+ * --timings: where the run spends its time. Each phase collects one sample
+ * per occurrence (per host in fleet mode) from a monotonic clock; the
+ * report at exit gives count, sum and percentiles per phase. Nothing is
+ * recorded unless `timings` is set.
+ */
+#define TIMINGS_TABLE 1
+#define TIMINGS_JSON  2
+
+#define PHASE_SSH_CHECK 0
+#define PHASE_KEY_READ  1
+#define PHASE_CONNECT   2
+#define PHASE_SCRIPT    3
+#define PHASE_FETCH     4
+#define PHASE_APPEND    5
+#define PHASE_VERIFY    6
+#define PHASE_HOST      7
+#define PHASE_COUNT     8
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "ssh check", "key read", "connect", "script", "fetch", "append", "verify", "host"
+};
+
+typedef struct {
+    int format;
+    double start;
+    double *samples[PHASE_COUNT];
+    size_t count[PHASE_COUNT];
+    size_t capacity[PHASE_COUNT];
+} Timings;
+
+static Timings *timings;
+
+/* Milliseconds on a clock that only moves forward */
+static double clock_ms(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+#endif
+}
+
+/* The time a phase starts at, 0 when nothing is timed */
+static double timing_start(void) {
+    return timings ? clock_ms() : 0;
+}
+
+/* Record a phase that began at `start` (from timing_start()) */
+static void timing_end(int phase, double start) {
+    double *samples;
+    size_t capacity;
+    
+    if (!timings) {
+        return;
+    }
+    if (timings->count[phase] == timings->capacity[phase]) {
+        capacity = timings->capacity[phase] ? timings->capacity[phase] * 2 : 16;
+        samples = realloc(timings->samples[phase], capacity * sizeof(double));
+        if (!samples) {
+            return;
+        }
+        timings->samples[phase] = samples;
+        timings->capacity[phase] = capacity;
+    }
+    timings->samples[phase][timings->count[phase]++] = clock_ms() - start;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of n sorted samples */
+static double percentile(const double *sorted, size_t n, int pct) {
+    size_t rank = (n * (size_t)pct + 99) / 100;
+    
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* atexit handler: print the phases that occurred to stderr, then free them */
+static void timings_report(void) {
+    const double *s;
+    double total = clock_ms() - timings->start;
+    double sum;
+    size_t n;
+    size_t i;
+    int first = 1;
+    int phase;
+    
+    /* After whatever the run printed */
+    fflush(stdout);
+    if (timings->format == TIMINGS_JSON) {
+        fprintf(stderr, "{\"total_ms\": %.3f, \"phases\": [", total);
+    } else {
+        fprintf(stderr, "%-10s %7s %10s %9s %9s %9s %9s\n",
+                "phase", "count", "total ms", "p50", "p90", "p99", "max");
+    }
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        n = timings->count[phase];
+        if (n == 0) {
+            continue;
+        }
+        qsort(timings->samples[phase], n, sizeof(double), double_cmp);
+        s = timings->samples[phase];
+        for (i = 0, sum = 0; i < n; i++) {
+            sum += s[i];
+        }
+        if (timings->format == TIMINGS_JSON) {
+            fprintf(stderr, "%s\n  {\"phase\": \"%s\", \"count\": %lu, \"total_ms\": %.3f, "
+                    "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+                    first ? "" : ",", phase_names[phase], (unsigned long)n, sum,
+                    percentile(s, n, 50), percentile(s, n, 90), percentile(s, n, 99), s[n - 1]);
+        } else {
+            fprintf(stderr, "%-10s %7lu %10.1f %9.1f %9.1f %9.1f %9.1f\n",
+                    phase_names[phase], (unsigned long)n, sum,
+                    percentile(s, n, 50), percentile(s, n, 90), percentile(s, n, 99), s[n - 1]);
+        }
+        first = 0;
+        free(timings->samples[phase]);
+    }
+    if (timings->format == TIMINGS_JSON) {
+        fprintf(stderr, "%s]}\n", first ? "" : "\n");
+    } else {
+        fprintf(stderr, "%-10s %7s %10.1f\n", "total", "", total);
+    }
+    free(timings);
+    timings = NULL;
+}
+
+/* Start timing the run (--timings); reported when the process exits */
+static void timings_init(int format) {
+    timings = calloc(1, sizeof(Timings));
+    if (!timings) {
+        return;
+    }
+    timings->format = format;
+    timings->start = clock_ms();
+    atexit(timings_report);
+}
+
+/* Check if SSH client is installed (looked up on PATH, no shell involved) */
+int check_ssh_installed(void) {
+#ifdef _WIN32
+    char path[MAX_PATH_LEN];
+    return SearchPathA(NULL, "ssh.exe", NULL, sizeof(path), path, NULL) > 0;
+#else
+    char path[MAX_PATH_LEN];
+    const char *dirs = getenv("PATH");
+    size_t len;
+    
+    if (!dirs) {
+        dirs = "/usr/bin:/bin";
+    }
+    while (*dirs) {
+        len = strcspn(dirs, ":");
+        snprintf(path, sizeof(path), "%.*s/ssh", (int)len, len ? dirs : ".");
+        if (access(path, X_OK) == 0) {
+            return 1;
+        }
+        dirs += len;
+        if (*dirs == ':') {
+            dirs++;
+        }
+    }
+    return 0;
+#endif
+}
+
+/* Append data to buffer, keeping it NUL-terminated */
+int buffer_append(Buffer *buf, const char *data, size_t len) {
+    if (buf->sink) {
+        return buf->sink(buf->sink_ctx, data, len);
+    }
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        char *p;
+        while (cap < buf->len + len + 1) {
+            cap *= 2;
+        }
+        p = realloc(buf->data, cap);
+        if (!p) {
+            return -1;
+        }
+        buf->data = p;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+void buffer_free(Buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+/*
+ * Process spawning.
+ * ssh is started directly from an argv array (CreateProcess on Windows,
+ * posix_spawn elsewhere) instead of through cmd.exe or /bin/sh: one process
+ * per step instead of two, and no local quoting of the remote command.
+ */
+#ifdef _WIN32
+/*
+ * Build a command line that the MSVC runtime splits back into argv:
+ * quote arguments with blanks or quotes, double backslashes before quotes.
+ */
+static char *build_command_line(char *const argv[]) {
+    size_t size = 1;
+    char *line;
+    char *p;
+    int i;
+    
+    for (i = 0; argv[i]; i++) {
+        size += strlen(argv[i]) * 2 + 3;
+    }
+    line = malloc(size);
+    if (!line) {
+        return NULL;
+    }
+    p = line;
+    for (i = 0; argv[i]; i++) {
+        const char *s = argv[i];
+        if (i > 0) {
+            *p++ = ' ';
+        }
+        if (*s && !strpbrk(s, " \t\n\v\"")) {
+            strcpy(p, s);
+            p += strlen(s);
+            continue;
+        }
+        *p++ = '"';
+        for (;;) {
+            size_t backslashes = 0;
+            while (*s == '\\') {
+                s++;
+                backslashes++;
+            }
+            if (*s == '\0') {
+                memset(p, '\\', backslashes * 2);
+                p += backslashes * 2;
+                break;
+            }
+            if (*s == '"') {
+                memset(p, '\\', backslashes * 2 + 1);
+                p += backslashes * 2 + 1;
+            } else {
+                memset(p, '\\', backslashes);
+                p += backslashes;
+            }
+            *p++ = *s++;
+        }
+        *p++ = '"';
+    }
+    *p = '\0';
+    return line;
+}
+
+/* Inheritable duplicate of one of our handles, or NULL */
+static HANDLE inheritable_copy(HANDLE handle) {
+    HANDLE copy = NULL;
+    
+    if (!handle || handle == INVALID_HANDLE_VALUE ||
+        !DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(), &copy,
+                         0, TRUE, DUPLICATE_SAME_ACCESS)) {
+        return NULL;
+    }
+    return copy;
+}
+
+/*
+ * Pipe between us and a child; `parent_reads` gives the direction. Only the
+ * child's end is inheritable. Anonymous pipes cannot do overlapped I/O, so
+ * for the event loop a uniquely named pipe is opened from both ends instead.
+ */
+static int make_pipe(HANDLE *parent_end, HANDLE *child_end, int parent_reads, int async) {
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    static volatile LONG serial;
+    char name[64];
+    BOOL ok;
+    
+    if (!async) {
+        ok = parent_reads ? CreatePipe(parent_end, child_end, &sa, 0)
+                          : CreatePipe(child_end, parent_end, &sa, 0);
+        if (!ok) {
+            *parent_end = *child_end = NULL;
+            return -1;
+        }
+        SetHandleInformation(*parent_end, HANDLE_FLAG_INHERIT, 0);
+        return 0;
+    }
+    
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\ssh-copy-id-%lu-%ld",
+             (unsigned long)GetCurrentProcessId(), (long)InterlockedIncrement(&serial));
+    *parent_end = CreateNamedPipeA(name, (parent_reads ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) |
+                                   FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                   PIPE_TYPE_BYTE | PIPE_WAIT, 1, 65536, 65536, 0, NULL);
+    if (*parent_end == INVALID_HANDLE_VALUE) {
+        *parent_end = *child_end = NULL;
+        return -1;
+    }
+    *child_end = CreateFileA(name, parent_reads ? GENERIC_WRITE : GENERIC_READ, 0, &sa,
+                             OPEN_EXISTING, 0, NULL);
+    if (*child_end == INVALID_HANDLE_VALUE) {
+        CloseHandle(*parent_end);
+        *parent_end = *child_end = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Start argv[0] with the requested stdin pipe and output flags. Only the
+ * child's three standard handles are inherited (PROC_THREAD_ATTRIBUTE_HANDLE_LIST),
+ * so pipes of concurrently spawned siblings never leak into it.
+ */
+int spawn_process(char *const argv[], int with_input, int output, Child *child) {
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    STARTUPINFOEXA si;
+    PROCESS_INFORMATION pi;
+    HANDLE std[3] = { NULL, NULL, NULL };
+    HANDLE inherit[3];
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = NULL;
+    SIZE_T attrs_size = 0;
+    DWORD flags = 0;
+    char *cmdline;
+    int async = (output & CHILD_ASYNC) != 0;
+    int count = 0;
+    int i;
+    BOOL ok;
+    
+    child->process = child->in = child->out = child->err = NULL;
+    cmdline = build_command_line(argv);
+    if (!cmdline) {
+        return -1;
+    }
+    
+    if (with_input) {
+        if (make_pipe(&child->in, &std[0], 0, async) != 0) {
+            free(cmdline);
+            return -1;
+        }
+    } else {
+        std[0] = inheritable_copy(GetStdHandle(STD_INPUT_HANDLE));
+    }
+    
+    if (output & CHILD_CAPTURE) {
+        make_pipe(&child->out, &std[1], 1, async);
+    } else if (output & CHILD_SILENT) {
+        std[1] = CreateFileA(NULL_DEVICE, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             &sa, OPEN_EXISTING, 0, NULL);
+        if (std[1] == INVALID_HANDLE_VALUE) {
+            std[1] = NULL;
+        }
+    } else {
+        std[1] = inheritable_copy(GetStdHandle(STD_OUTPUT_HANDLE));
+    }
+    if (output & CHILD_CAPTURE_ERR) {
+        make_pipe(&child->err, &std[2], 1, async);
+    } else if (output & CHILD_SILENT) {
+        std[2] = inheritable_copy(std[1]);
+    } else {
+        std[2] = inheritable_copy(GetStdHandle(STD_ERROR_HANDLE));
+    }
+    
+    for (i = 0; i < 3; i++) {
+        if (std[i]) {
+            inherit[count++] = std[i];
+        }
+    }
+    
+    memset(&si, 0, sizeof(si));
+    si.StartupInfo.cb = sizeof(si);
+    si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    si.StartupInfo.hStdInput = std[0];
+    si.StartupInfo.hStdOutput = std[1];
+    si.StartupInfo.hStdError = std[2];
+    
+    if (count > 0) {
+        InitializeProcThreadAttributeList(NULL, 1, 0, &attrs_size);
+        attrs = malloc(attrs_size);
+        if (attrs && InitializeProcThreadAttributeList(attrs, 1, 0, &attrs_size) &&
+            UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                      inherit, count * sizeof(HANDLE), NULL, NULL)) {
+            si.lpAttributeList = attrs;
+            flags = EXTENDED_STARTUPINFO_PRESENT;
+        }
+    }
+    
+    ok = CreateProcessA(NULL, cmdline, NULL, NULL, flags != 0, flags, NULL, NULL,
+                        &si.StartupInfo, &pi);
+    
+    if (attrs) {
+        if (si.lpAttributeList) {
+            DeleteProcThreadAttributeList(attrs);
+        }
+        free(attrs);
+    }
+    free(cmdline);
+    for (i = 0; i < 3; i++) {
+        if (std[i]) {
+            CloseHandle(std[i]);
+        }
+    }
+    if (!ok) {
+        if (child->in) {
+            CloseHandle(child->in);
+        }
+        if (child->out) {
+            CloseHandle(child->out);
+        }
+        if (child->err) {
+            CloseHandle(child->err);
+        }
+        child->in = child->out = child->err = NULL;
+        return -1;
+    }
+    CloseHandle(pi.hThread);
+    child->process = pi.hProcess;
+    return 0;
+}
+
+/* Wait for the child and return its exit code */
+int wait_process(Child *child) {
+    DWORD code = (DWORD)-1;
+    
+    if (child->in) {
+        CloseHandle(child->in);
+        child->in = NULL;
+    }
+    if (child->out) {
+        CloseHandle(child->out);
+        child->out = NULL;
+    }
+    if (child->err) {
+        CloseHandle(child->err);
+        child->err = NULL;
+    }
+    if (!child->process) {
+        return -1;
+    }
+    WaitForSingleObject(child->process, INFINITE);
+    GetExitCodeProcess(child->process, &code);
+    CloseHandle(child->process);
+    child->process = NULL;
+    return (int)code;
+}
+
+/* Feeds a child's stdin from a separate thread while we read its stdout */
+typedef struct {
+    HANDLE pipe;
+    const char *data;
+    size_t len;
+} PipeWriter;
+
+static DWORD WINAPI pipe_writer(LPVOID arg) {
+    PipeWriter *writer = arg;
+    DWORD written;
+    
+    while (writer->len > 0) {
+        DWORD chunk = writer->len > 65536 ? 65536 : (DWORD)writer->len;
+        if (!WriteFile(writer->pipe, writer->data, chunk, &written, NULL)) {
+            /* The child exited early; its exit code says why */
+            break;
+        }
+        writer->data += written;
+        writer->len -= written;
+    }
+    CloseHandle(writer->pipe);
+    return 0;
+}
+
+/*
+ * Run a process to completion: feed it `input` (if not NULL), collect
+ * its stdout into `captured` for CHILD_CAPTURE. Returns the exit code or
+ * -1 if it could not be started.
+ */
+int run_process(char *const argv[], const char *input, size_t input_len,
+                int output, Buffer *captured) {
+    Child child;
+    PipeWriter writer;
+    HANDLE thread = NULL;
+    char chunk[4096];
+    DWORD got;
+    
+    if (spawn_process(argv, input != NULL, output, &child) != 0) {
+        return -1;
+    }
+    if (child.in) {
+        writer.pipe = child.in;
+        writer.data = input;
+        writer.len = input_len;
+        child.in = NULL;
+        if (child.out) {
+            thread = CreateThread(NULL, 0, pipe_writer, &writer, 0, NULL);
+        }
+        if (!thread) {
+            pipe_writer(&writer);
+        }
+    }
+    if (child.out) {
+        while (ReadFile(child.out, chunk, sizeof(chunk), &got, NULL) && got > 0) {
+            if (captured) {
+                buffer_append(captured, chunk, got);
+            }
+        }
+    }
+    if (thread) {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+    return wait_process(&child);
+}
+#else
+static int pipe_cloexec(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/*
+ * Start argv[0] (looked up on PATH) with the requested stdin pipe and
+ * output flags. Our pipe ends are close-on-exec, so concurrently spawned
+ * siblings never inherit each other's pipes.
+ */
+int spawn_process(char *const argv[], int with_input, int output, Child *child) {
+    posix_spawn_file_actions_t actions;
+    int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    int wanted[3];
+    int rc = -1;
+    int i;
+    
+    child->pid = -1;
+    child->in = child->out = child->err = -1;
+    wanted[0] = with_input;
+    wanted[1] = (output & CHILD_CAPTURE) != 0;
+    wanted[2] = (output & CHILD_CAPTURE_ERR) != 0;
+    for (i = 0; i < 3; i++) {
+        if (wanted[i] && pipe_cloexec(pipes[i]) != 0) {
+            goto done;
+        }
+    }
+    
+    posix_spawn_file_actions_init(&actions);
+    if (wanted[0]) {
+        posix_spawn_file_actions_adddup2(&actions, pipes[0][0], STDIN_FILENO);
+    }
+    if (wanted[1]) {
+        posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDOUT_FILENO);
+    } else if (output & CHILD_SILENT) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, NULL_DEVICE, O_WRONLY, 0);
+    }
+    if (wanted[2]) {
+        posix_spawn_file_actions_adddup2(&actions, pipes[2][1], STDERR_FILENO);
+    } else if (output & CHILD_SILENT) {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, NULL_DEVICE, O_WRONLY, 0);
+    }
+    rc = posix_spawnp(&child->pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    
+done:
+    /* Close the child's ends; on failure ours too */
+    for (i = 0; i < 3; i++) {
+        if (pipes[i][0] < 0) {
+            continue;
+        }
+        close(i == 0 ? pipes[i][0] : pipes[i][1]);
+        if (rc != 0) {
+            close(i == 0 ? pipes[i][1] : pipes[i][0]);
+        }
+    }
+    if (rc != 0) {
+        child->pid = -1;
+        return -1;
+    }
+    child->in = pipes[0][1];
+    child->out = pipes[1][0];
+    child->err = pipes[2][0];
+    return 0;
+}
+
+/* Wait for the child and return its exit code (-1 if it was killed) */
+int wait_process(Child *child) {
+    int status;
+    
+    if (child->in >= 0) {
+        close(child->in);
+        child->in = -1;
+    }
+    if (child->out >= 0) {
+        close(child->out);
+        child->out = -1;
+    }
+    if (child->err >= 0) {
+        close(child->err);
+        child->err = -1;
+    }
+    if (child->pid <= 0) {
+        return -1;
+    }
+    while (waitpid(child->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    child->pid = -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Run a process to completion: feed it `input` (if not NULL), collect
+ * its stdout into `captured` for CHILD_CAPTURE. Both pipes are pumped with
+ * poll() so a child that writes before reading cannot deadlock us.
+ * Returns the exit code or -1 if it could not be started.
+ */
+int run_process(char *const argv[], const char *input, size_t input_len,
+                int output, Buffer *captured) {
+    Child child;
+    struct pollfd fds[2];
+    char chunk[4096];
+    ssize_t n;
+    int count;
+    
+    if (spawn_process(argv, input != NULL, output, &child) != 0) {
+        return -1;
+    }
+    if (child.in >= 0) {
+        fcntl(child.in, F_SETFL, fcntl(child.in, F_GETFL) | O_NONBLOCK);
+    }
+    
+    while (child.in >= 0 || child.out >= 0) {
+        count = 0;
+        if (child.in >= 0) {
+            fds[count].fd = child.in;
+            fds[count].events = POLLOUT;
+            count++;
+        }
+        if (child.out >= 0) {
+            fds[count].fd = child.out;
+            fds[count].events = POLLIN;
+            count++;
+        }
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (count--; count >= 0; count--) {
+            if (!fds[count].revents) {
+                continue;
+            }
+            if (fds[count].fd == child.in) {
+                n = input_len > 0 ? write(child.in, input, input_len) : 0;
+                if (n > 0) {
+                    input += n;
+                    input_len -= (size_t)n;
+                }
+                /* Done, or the child exited early: its exit code says why */
+                if (input_len == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    close(child.in);
+                    child.in = -1;
+                }
+            } else {
+                n = read(child.out, chunk, sizeof(chunk));
+                if (n > 0) {
+                    if (captured) {
+                        buffer_append(captured, chunk, (size_t)n);
+                    }
+                } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    close(child.out);
+                    child.out = -1;
+                }
+            }
+        }
+    }
+    return wait_process(&child);
+}
+#endif
+
+/*
+ * Event loop for many concurrent children.
+ * A single thread watches the pipes and the exit of every running child:
+ * IOCP on Windows, epoll plus pidfds on Linux, poll() elsewhere. Output is
+ * collected per job, and the job's callback runs once the child has exited
+ * and its pipes are drained. Callbacks may start new jobs.
+ */
+#define JOB_IN  0
+#define JOB_OUT 1
+#define JOB_ERR 2
+#define JOB_PID 3
+
+#ifdef _WIN32
+/* Exit notifications arrive on a pool thread; forward them to the port */
+static VOID CALLBACK job_exited(PVOID arg, BOOLEAN timed_out) {
+    Job *job = arg;
+    
+    (void)timed_out;
+    PostQueuedCompletionStatus(job->loop->iocp, 0, (ULONG_PTR)job, &job->ov_exit);
+}
+
+/*
+ * Queue the next read on one of the job's output pipes. Once the child has
+ * exited, only data already in the pipe is wanted: a read that would wait
+ * is cancelled (a daemonized descendant may hold the pipe open forever).
+ */
+static void job_read(Job *job, int kind) {
+    HANDLE *pipe = kind == JOB_OUT ? &job->child.out : &job->child.err;
+    OVERLAPPED *ov = kind == JOB_OUT ? &job->ov_out : &job->ov_err;
+    char *chunk = kind == JOB_OUT ? job->out_chunk : job->err_chunk;
+    
+    memset(ov, 0, sizeof(*ov));
+    if (ReadFile(*pipe, chunk, sizeof(job->out_chunk), NULL, ov) ||
+        GetLastError() == ERROR_IO_PENDING) {
+        job->pending++;
+        if (job->exited) {
+            CancelIoEx(*pipe, ov);
+        }
+        return;
+    }
+    CloseHandle(*pipe);
+    *pipe = NULL;
+}
+
+int loop_init(EventLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+    loop->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    return loop->iocp ? 0 : -1;
+}
+
+void loop_free(EventLoop *loop) {
+    if (loop->iocp) {
+        CloseHandle(loop->iocp);
+        loop->iocp = NULL;
+    }
+}
+
+/*
+ * Start a child with stdout and stderr captured and `input` (may be NULL)
+ * fed to its stdin. With `sink` set, stdout is passed to it along with
+ * `ctx` as it arrives instead. `input` must stay valid until `done` has run.
+ */
+int loop_spawn(EventLoop *loop, char *const argv[], const char *input, size_t input_len,
+               BufferSink sink, JobDone done, void *ctx) {
+    Job *job = calloc(1, sizeof(Job));
+    
+    if (!job) {
+        return -1;
+    }
+    if (spawn_process(argv, input != NULL, CHILD_CAPTURE | CHILD_CAPTURE_ERR | CHILD_ASYNC,
+                      &job->child) != 0) {
+        free(job);
+        return -1;
+    }
+    job->loop = loop;
+    job->out.sink = sink;
+    job->out.sink_ctx = ctx;
+    job->done = done;
+    job->ctx = ctx;
+    job->status = -1;
+    if (job->child.in) {
+        CreateIoCompletionPort(job->child.in, loop->iocp, (ULONG_PTR)job, 0);
+    }
+    if (job->child.out) {
+        CreateIoCompletionPort(job->child.out, loop->iocp, (ULONG_PTR)job, 0);
+    }
+    if (job->child.err) {
+        CreateIoCompletionPort(job->child.err, loop->iocp, (ULONG_PTR)job, 0);
+    }
+    
+    if (job->child.in && input_len > 0 && input_len <= 0x7fffffff &&
+        (WriteFile(job->child.in, input, (DWORD)input_len, NULL, &job->ov_in) ||
+         GetLastError() == ERROR_IO_PENDING)) {
+        job->pending++;
+    } else if (job->child.in) {
+        CloseHandle(job->child.in);
+        job->child.in = NULL;
+    }
+    if (job->child.out) {
+        job_read(job, JOB_OUT);
+    }
+    if (job->child.err) {
+        job_read(job, JOB_ERR);
+    }
+    if (!RegisterWaitForSingleObject(&job->wait, job->child.process, job_exited, job,
+                                     INFINITE, WT_EXECUTEONLYONCE)) {
+        /* Cannot be told about the exit; wait for it right here */
+        WaitForSingleObject(job->child.process, INFINITE);
+        job->wait = NULL;
+        job_exited(job, FALSE);
+    }
+    
+    job->next = loop->jobs;
+    loop->jobs = job;
+    loop->active++;
+    return 0;
+}
+
+/* Unlink a finished job, run its callback and free it */
+static void job_finish(EventLoop *loop, Job *job) {
+    Job **link = &loop->jobs;
+    
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    loop->active--;
+    
+    if (job->wait) {
+        UnregisterWaitEx(job->wait, INVALID_HANDLE_VALUE);
+    }
+    job->status = wait_process(&job->child);
+    job->done(job, job->ctx);
+    buffer_free(&job->out);
+    buffer_free(&job->err);
+    free(job);
+}
+
+/*
+ * Wait up to `timeout_ms` (-1: no limit) for one completion and handle it.
+ * Returns -1 if the loop is broken.
+ */
+int loop_run_once(EventLoop *loop, int timeout_ms) {
+    OVERLAPPED *ov = NULL;
+    ULONG_PTR key = 0;
+    DWORD got = 0;
+    Job *job;
+    BOOL ok;
+    
+    ok = GetQueuedCompletionStatus(loop->iocp, &got, &key, &ov,
+                                   timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+    if (!ov) {
+        return !ok && GetLastError() == WAIT_TIMEOUT ? 0 : -1;
+    }
+    job = (Job *)key;
+    
+    if (ov == &job->ov_exit) {
+        job->exited = 1;
+        if (job->child.in) {
+            CancelIoEx(job->child.in, &job->ov_in);
+        }
+        if (job->child.out) {
+            CancelIoEx(job->child.out, &job->ov_out);
+        }
+        if (job->child.err) {
+            CancelIoEx(job->child.err, &job->ov_err);
+        }
+    } else if (ov == &job->ov_in) {
+        /* Written in full, or the child went away: its exit code says why */
+        job->pending--;
+        CloseHandle(job->child.in);
+        job->child.in = NULL;
+    } else {
+        int kind = ov == &job->ov_out ? JOB_OUT : JOB_ERR;
+        
+        job->pending--;
+        if (ok && got > 0) {
+            buffer_append(kind == JOB_OUT ? &job->out : &job->err,
+                          kind == JOB_OUT ? job->out_chunk : job->err_chunk, got);
+            job_read(job, kind);
+        } else if (kind == JOB_OUT) {
+            CloseHandle(job->child.out);
+            job->child.out = NULL;
+        } else {
+            CloseHandle(job->child.err);
+            job->child.err = NULL;
+        }
+    }
+    
+    if (job->exited && job->pending == 0) {
+        job_finish(loop, job);
+    }
+    return 0;
+}
+#else
+#ifdef __linux__
+static int job_watch(EventLoop *loop, Job *job, int fd, int kind) {
+    struct epoll_event ev;
+    
+    job->watch[kind].job = job;
+    job->watch[kind].kind = kind;
+    ev.events = kind == JOB_IN ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = &job->watch[kind];
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+#endif
+
+/* Stop watching and close one of the job's descriptors */
+static void job_close(EventLoop *loop, int *fd) {
+    if (*fd < 0) {
+        return;
+    }
+#ifdef __linux__
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, *fd, NULL);
+#else
+    (void)loop;
+#endif
+    close(*fd);
+    *fd = -1;
+}
+
+/* Collect the exit status if the child is gone */
+static void job_reap(Job *job) {
+    int status;
+    pid_t rc;
+    
+    if (job->exited) {
+        return;
+    }
+    do {
+        rc = waitpid(job->child.pid, &status, WNOHANG);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) {
+        return;
+    }
+    job->exited = 1;
+    job->status = rc > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    job->child.pid = -1;
+}
+
+/* Service one ready descriptor of a job */
+static void job_ready(EventLoop *loop, Job *job, int kind) {
+    char chunk[4096];
+    ssize_t n;
+    
+    if (kind == JOB_PID) {
+        job_reap(job);
+        return;
+    }
+    if (kind == JOB_IN) {
+        n = job->input_len > 0 ? write(job->child.in, job->input, job->input_len) : 0;
+        if (n > 0) {
+            job->input += n;
+            job->input_len -= (size_t)n;
+        }
+        /* Done, or the child exited early: its exit code says why */
+        if (job->input_len == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            job_close(loop, &job->child.in);
+        }
+        return;
+    }
+    
+    /* Non-blocking, so read until the pipe is empty */
+    for (;;) {
+        int *fd = kind == JOB_OUT ? &job->child.out : &job->child.err;
+        
+        if (*fd < 0) {
+            return;
+        }
+        n = read(*fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            buffer_append(kind == JOB_OUT ? &job->out : &job->err, chunk, (size_t)n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0 || errno != EAGAIN) {
+                job_close(loop, fd);
+            }
+            return;
+        }
+    }
+}
+
+int loop_init(EventLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+#ifdef __linux__
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epfd < 0 ? -1 : 0;
+#else
+    return 0;
+#endif
+}
+
+void loop_free(EventLoop *loop) {
+#ifdef __linux__
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+#else
+    (void)loop;
+#endif
+}
+
+/*
+ * Start a child with stdout and stderr captured and `input` (may be NULL)
+ * fed to its stdin. With `sink` set, stdout is passed to it along with
+ * `ctx` as it arrives instead. `input` must stay valid until `done` has run.
+ */
+int loop_spawn(EventLoop *loop, char *const argv[], const char *input, size_t input_len,
+               BufferSink sink, JobDone done, void *ctx) {
+    Job *job = calloc(1, sizeof(Job));
+    
+    if (!job) {
+        return -1;
+    }
+    if (spawn_process(argv, input != NULL, CHILD_CAPTURE | CHILD_CAPTURE_ERR | CHILD_ASYNC,
+                      &job->child) != 0) {
+        free(job);
+        return -1;
+    }
+    job->loop = loop;
+    job->input = input;
+    job->input_len = input_len;
+    job->out.sink = sink;
+    job->out.sink_ctx = ctx;
+    job->done = done;
+    job->ctx = ctx;
+    job->status = -1;
+    job->pidfd = -1;
+    if (job->child.in >= 0) {
+        fcntl(job->child.in, F_SETFL, fcntl(job->child.in, F_GETFL) | O_NONBLOCK);
+    }
+    fcntl(job->child.out, F_SETFL, fcntl(job->child.out, F_GETFL) | O_NONBLOCK);
+    fcntl(job->child.err, F_SETFL, fcntl(job->child.err, F_GETFL) | O_NONBLOCK);
+    
+#ifdef __linux__
+    if (job->child.in >= 0) {
+        job_watch(loop, job, job->child.in, JOB_IN);
+    }
+    job_watch(loop, job, job->child.out, JOB_OUT);
+    job_watch(loop, job, job->child.err, JOB_ERR);
+#ifdef SYS_pidfd_open
+    /* Without pidfds (before Linux 5.3) exits are found by polling waitpid */
+    job->pidfd = (int)syscall(SYS_pidfd_open, job->child.pid, 0);
+    if (job->pidfd >= 0) {
+        fcntl(job->pidfd, F_SETFD, FD_CLOEXEC);
+        if (job_watch(loop, job, job->pidfd, JOB_PID) != 0) {
+            close(job->pidfd);
+            job->pidfd = -1;
+        }
+    }
+#endif
+#endif
+    
+    job->next = loop->jobs;
+    loop->jobs = job;
+    loop->active++;
+    return 0;
+}
+
+/*
+ * Wait up to `timeout_ms` (-1: no limit) for activity and handle it, then
+ * finish every job whose child has exited. Returns -1 if the loop is broken.
+ */
+int loop_run_once(EventLoop *loop, int timeout_ms) {
+    Job *job;
+    Job **link;
+    int timeout = timeout_ms;
+    int count;
+    int i;
+    
+    /* Exits we cannot watch for are found by polling */
+    for (job = loop->jobs; job; job = job->next) {
+        if (job->pidfd < 0) {
+            if (timeout < 0 || timeout > 100) {
+                timeout = 100;
+            }
+            break;
+        }
+    }
+    
+#ifdef __linux__
+    {
+        struct epoll_event events[64];
+        
+        count = epoll_wait(loop->epfd, events, 64, timeout);
+        if (count < 0 && errno != EINTR) {
+            return -1;
+        }
+        for (i = 0; i < count; i++) {
+            JobWatch *watch = events[i].data.ptr;
+            job_ready(loop, watch->job, watch->kind);
+        }
+    }
+#else
+    {
+        struct pollfd *fds;
+        Job **owners;
+        int *kinds;
+        
+        fds = malloc(loop->active * 3 * sizeof(*fds) + 1);
+        owners = malloc(loop->active * 3 * sizeof(*owners) + 1);
+        kinds = malloc(loop->active * 3 * sizeof(*kinds) + 1);
+        if (!fds || !owners || !kinds) {
+            free(fds);
+            free(owners);
+            free(kinds);
+            return -1;
+        }
+        count = 0;
+        for (job = loop->jobs; job; job = job->next) {
+            int *fd[3];
+            
+            fd[JOB_IN] = &job->child.in;
+            fd[JOB_OUT] = &job->child.out;
+            fd[JOB_ERR] = &job->child.err;
+            for (i = JOB_IN; i <= JOB_ERR; i++) {
+                if (*fd[i] >= 0) {
+                    fds[count].fd = *fd[i];
+                    fds[count].events = i == JOB_IN ? POLLOUT : POLLIN;
+                    owners[count] = job;
+                    kinds[count] = i;
+                    count++;
+                }
+            }
+        }
+        if (poll(fds, count, timeout) > 0) {
+            for (i = 0; i < count; i++) {
+                if (fds[i].revents) {
+                    job_ready(loop, owners[i], kinds[i]);
+                }
+            }
+        }
+        free(fds);
+        free(owners);
+        free(kinds);
+    }
+#endif
+    
+    for (job = loop->jobs; job; job = job->next) {
+        if (job->pidfd < 0 && !job->exited) {
+            job_reap(job);
+        }
+    }
+    
+    /* New jobs are pushed at the head, so callbacks may start more */
+    link = &loop->jobs;
+    while ((job = *link) != NULL) {
+        if (!job->exited) {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        loop->active--;
+        /* Take what is left in the pipes without waiting for EOF */
+        job_ready(loop, job, JOB_OUT);
+        job_ready(loop, job, JOB_ERR);
+        job_close(loop, &job->child.in);
+        job_close(loop, &job->child.out);
+        job_close(loop, &job->child.err);
+        job_close(loop, &job->pidfd);
+        job->done(job, job->ctx);
+        buffer_free(&job->out);
+        buffer_free(&job->err);
+        free(job);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Build the argv of one ssh call to the host.
+ * `extra` goes first so its -o values win over ours (ssh keeps the first);
+ * `remote_cmd` (may be NULL) is passed as a single argument.
+ */
+void build_ssh_argv(Options *opts, const char *const extra[], const char *remote_cmd,
+                    SshArgv *args) {
+    int i;
+    
+    args->argc = 0;
+    args->argv[args->argc++] = "ssh";
+    for (i = 0; extra && extra[i] && args->argc < MAX_SSH_ARGS - 14; i++) {
+        args->argv[args->argc++] = (char *)extra[i];
+    }
+    
+    if (opts->ssh_config[0] != '\0') {
+        strcpy(args->config, opts->ssh_config);
+        args->argv[args->argc++] = "-F";
+        args->argv[args->argc++] = args->config;
+    }
+    
+    if (opts->port > 0 && opts->port != 22) {
+        snprintf(args->port, sizeof(args->port), "%d", opts->port);
+        args->argv[args->argc++] = "-p";
+        args->argv[args->argc++] = args->port;
+    }
+    
+    if (opts->ssh_options[0] != '\0') {
+        strcpy(args->ssh_options, opts->ssh_options);
+        args->argv[args->argc++] = "-o";
+        args->argv[args->argc++] = args->ssh_options;
+    }
+    
+    /* A check must never stop to ask for a password */
+    if (opts->check) {
+        args->argv[args->argc++] = "-o";
+        args->argv[args->argc++] = "BatchMode=yes";
+    }
+    
+    if (opts->control_path[0] != '\0') {
+        snprintf(args->control_path, sizeof(args->control_path), "ControlPath=\"%s\"",
+                 opts->control_path);
+        args->argv[args->argc++] = "-o";
+        args->argv[args->argc++] = args->control_path;
+    }
+    
+    args->argv[args->argc++] = "-o";
+    args->argv[args->argc++] = "StrictHostKeyChecking=accept-new";
+    snprintf(args->destination, sizeof(args->destination), "%s@%s", opts->user, opts->host);
+    args->argv[args->argc++] = args->destination;
+    if (remote_cmd) {
+        args->argv[args->argc++] = (char *)remote_cmd;
+    }
+    args->argv[args->argc] = NULL;
+}
+
+/* Execute SSH command */
+int run_ssh_command(Options *opts, const char *remote_cmd) {
+    SshArgv args;
+    
+    build_ssh_argv(opts, NULL, remote_cmd, &args);
+    return run_process(args.argv, NULL, 0, CHILD_INHERIT, NULL);
+}
+
+/*
+ * Execute SSH command feeding `input` to its stdin, collecting its stdout
+ * in `captured` unless that is NULL.
+ * Payloads go through the pipe rather than the command line, so they are
+ * not limited by the command-line length and need no shell escaping.
+ */
+int run_ssh_command_input(Options *opts, const char *remote_cmd,
+                          const char *input, size_t input_len, Buffer *captured) {
+    SshArgv args;
+    
+    build_ssh_argv(opts, NULL, remote_cmd, &args);
+    return run_process(args.argv, input, input_len,
+                       captured ? CHILD_CAPTURE : CHILD_INHERIT, captured);
+}
+
+#ifdef USE_LIBSSH2
+/*
+ * In-process transport (make USE_LIBSSH2=1).
+ * Connect, host key check, authentication and the exec channel run inside
+ * this process with libssh2 instead of one ssh child per step. libssh2
+ * does not read ssh_config, so runs with -F or -o, and hosts it cannot
+ * resolve (e.g. config aliases), still go through the ssh binary.
+ */
+/* native_run() result: use the ssh binary instead */
+#define NATIVE_UNAVAILABLE (-2)
+
+/* Fleet hosts that are not logged in by then are given up */
+#define NATIVE_LOGIN_TIMEOUT 60
+
+typedef struct {
+    socket_t sock;
+    LIBSSH2_SESSION *session;
+    const char *password;
+} NativeSession;
+
+static int native_initialized;
+
+/* Can the in-process transport honour these options? */
+static int native_usable(const Options *opts) {
+    return opts->ssh_config[0] == '\0' && opts->ssh_options[0] == '\0';
+}
+
+static int native_init(void) {
+    if (!native_initialized) {
+        if (libssh2_init(0) != 0) {
+            return -1;
+        }
+        atexit(libssh2_exit);
+        native_initialized = 1;
+    }
+    return 0;
+}
+
+/* Print a message to stderr, or collect it in `log` for a fleet host */
+static void native_message(Buffer *log, const char *fmt, ...) {
+    char text[1024];
+    va_list ap;
+    int len;
+    
+    va_start(ap, fmt);
+    len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= sizeof(text)) {
+        len = (int)sizeof(text) - 1;
+    }
+    if (log) {
+        buffer_append(log, text, (size_t)len);
+    } else {
+        fputs(text, stderr);
+    }
+}
+
+/* Resolve the host; NULL means it is unknown to DNS (maybe an ssh_config alias) */
+static struct addrinfo *native_resolve(const Options *opts) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char port[16];
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", opts->port > 0 ? opts->port : 22);
+    return getaddrinfo(opts->host, port, &hints, &res) == 0 ? res : NULL;
+}
+
+/* Open a TCP connection to the host, trying every address it resolves to */
+static int native_connect(const Options *opts, socket_t *sock) {
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    
+    res = native_resolve(opts);
+    if (!res) {
+        return NATIVE_UNAVAILABLE;
+    }
+    *sock = INVALID_SOCKET;
+    for (ai = res; ai; ai = ai->ai_next) {
+        *sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (*sock == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(*sock, ai->ai_addr, (int)ai->ai_addrlen) == 0) {
+            break;
+        }
+        close_socket(*sock);
+        *sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    if (*sock == INVALID_SOCKET) {
+        fprintf(stderr, "ssh: connect to host %s port %d failed\n", opts->host,
+                opts->port > 0 ? opts->port : 22);
+        return SSH_CONNECT_FAILED;
+    }
+    return 0;
+}
+
+/* Parse ~/.ssh/known_hosts; `owner` is any session, used for allocation */
+static int known_hosts_load(LIBSSH2_SESSION *owner, KnownHosts *kh) {
+    const char *home = get_home_dir();
+    
+    kh->known = NULL;
+    if (!home || snprintf(kh->path, sizeof(kh->path), "%s" PATH_SEP ".ssh" PATH_SEP "known_hosts",
+                          home) >= (int)sizeof(kh->path)) {
+        return -1;
+    }
+    kh->known = libssh2_knownhost_init(owner);
+    if (!kh->known) {
+        return -1;
+    }
+    /* A missing file just means no host is known yet */
+    libssh2_knownhost_readfile(kh->known, kh->path, LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+    return 0;
+}
+
+static void known_hosts_free(KnownHosts *kh) {
+    if (kh->known) {
+        libssh2_knownhost_free(kh->known);
+        kh->known = NULL;
+    }
+}
+
+/*
+ * Check the session's host key. Unknown hosts are appended to the file
+ * (StrictHostKeyChecking=accept-new, as the ssh path uses); changed keys
+ * are refused.
+ */
+static int native_check_host(KnownHosts *kh, LIBSSH2_SESSION *session, const Options *opts,
+                             Buffer *log) {
+    struct libssh2_knownhost *entry;
+    char name[300];
+    char line[4096];
+    const char *key;
+    size_t key_len;
+    size_t line_len;
+    int port = opts->port > 0 ? opts->port : 22;
+    int key_type;
+    int type_mask = 0;
+    int check;
+    FILE *fp;
+    
+    key = libssh2_session_hostkey(session, &key_len, &key_type);
+    switch (key_type) {
+    case LIBSSH2_HOSTKEY_TYPE_RSA:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_SSHRSA;
+        break;
+    case LIBSSH2_HOSTKEY_TYPE_DSS:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_SSHDSS;
+        break;
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_256:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_ECDSA_256;
+        break;
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_384:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_ECDSA_384;
+        break;
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_521:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_ECDSA_521;
+        break;
+    case LIBSSH2_HOSTKEY_TYPE_ED25519:
+        type_mask = LIBSSH2_KNOWNHOST_KEY_ED25519;
+        break;
+    default:
+        key = NULL;
+        break;
+    }
+    if (!key || !kh->known) {
+        native_message(log, "Host key verification failed.\n");
+        return -1;
+    }
+    type_mask |= LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW;
+    if (port == 22) {
+        snprintf(name, sizeof(name), "%s", opts->host);
+    } else {
+        snprintf(name, sizeof(name), "[%s]:%d", opts->host, port);
+    }
+    
+    check = libssh2_knownhost_checkp(kh->known, opts->host, port, key, key_len, type_mask, NULL);
+    if (check == LIBSSH2_KNOWNHOST_CHECK_NOTFOUND) {
+        /* Append just the new line; rewriting would drop lines libssh2 cannot parse */
+        if (libssh2_knownhost_addc(kh->known, name, NULL, key, key_len, NULL, 0,
+                                   type_mask, &entry) == 0 &&
+            libssh2_knownhost_writeline(kh->known, entry, line, sizeof(line), &line_len,
+                                        LIBSSH2_KNOWNHOST_FILE_OPENSSH) == 0 &&
+            (fp = fopen(kh->path, "a")) != NULL) {
+            fwrite(line, 1, line_len, fp);
+            fclose(fp);
+            if (!opts->quiet) {
+                native_message(log, "Warning: Permanently added '%s' to the list of known hosts.\n",
+                               name);
+            }
+        }
+        check = LIBSSH2_KNOWNHOST_CHECK_MATCH;
+    } else if (check == LIBSSH2_KNOWNHOST_CHECK_MISMATCH) {
+        native_message(log, "WARNING: the host key for %s has changed (see %s).\n", name, kh->path);
+    }
+    
+    if (check != LIBSSH2_KNOWNHOST_CHECK_MATCH) {
+        native_message(log, "Host key verification failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Key files tried after the agent, as ssh does */
+static const char *const native_default_keys[] = { "id_ed25519", "id_ecdsa", "id_rsa", NULL };
+
+/* Answer every keyboard-interactive prompt with the password read earlier */
+static void native_kbd_reply(const char *name, int name_len, const char *instruction,
+                             int instruction_len, int num_prompts,
+                             const LIBSSH2_USERAUTH_KBDINT_PROMPT *prompts,
+                             LIBSSH2_USERAUTH_KBDINT_RESPONSE *responses, void **abstract) {
+    NativeSession *s = *abstract;
+    int i;
+    
+    (void)name;
+    (void)name_len;
+    (void)instruction;
+    (void)instruction_len;
+    (void)prompts;
+    for (i = 0; i < num_prompts; i++) {
+        responses[i].text = strdup(s->password);
+        responses[i].length = responses[i].text ? (unsigned int)strlen(s->password) : 0;
+    }
+}
+
+/*
+ * Log in like ssh does: agent keys, the default key files, then up to
+ * three password tries. With `key` set only that private key is offered,
+ * as for a BatchMode login with -i.
+ */
+static int native_auth(NativeSession *s, const Options *opts, const char *key) {
+    LIBSSH2_AGENT *agent;
+    struct libssh2_agent_publickey *identity;
+    struct libssh2_agent_publickey *prev;
+    char private_key[MAX_PATH_LEN];
+    char public_key[MAX_PATH_LEN + 8];
+    char password[256];
+    char prompt[600];
+    const char *home = get_home_dir();
+    const char *methods;
+    unsigned int user_len = (unsigned int)strlen(opts->user);
+    int tries;
+    int rc;
+    int i;
+    
+    if (key) {
+        snprintf(public_key, sizeof(public_key), "%s.pub", key);
+        return libssh2_userauth_publickey_fromfile_ex(s->session, opts->user, user_len,
+                                                      public_key, key, NULL) == 0 ? 0 : -1;
+    }
+    
+    methods = libssh2_userauth_list(s->session, opts->user, user_len);
+    if (!methods) {
+        /* The server accepted "none" */
+        return libssh2_userauth_authenticated(s->session) ? 0 : -1;
+    }
+    
+    if (strstr(methods, "publickey")) {
+        agent = libssh2_agent_init(s->session);
+        if (agent && libssh2_agent_connect(agent) == 0) {
+            if (libssh2_agent_list_identities(agent) == 0) {
+                for (prev = NULL; libssh2_agent_get_identity(agent, &identity, prev) == 0;
+                     prev = identity) {
+                    if (libssh2_agent_userauth(agent, opts->user, identity) == 0) {
+                        break;
+                    }
+                }
+            }
+            libssh2_agent_disconnect(agent);
+        }
+        if (agent) {
+            libssh2_agent_free(agent);
+        }
+        for (i = 0; home && native_default_keys[i] &&
+                    !libssh2_userauth_authenticated(s->session); i++) {
+            if (snprintf(private_key, sizeof(private_key), "%s" PATH_SEP ".ssh" PATH_SEP "%s",
+                         home, native_default_keys[i]) >= (int)sizeof(private_key)) {
+                break;
+            }
+            snprintf(public_key, sizeof(public_key), "%s.pub", private_key);
+            if (file_exists(private_key)) {
+                libssh2_userauth_publickey_fromfile_ex(s->session, opts->user, user_len,
+                                                       public_key, private_key, NULL);
+            }
+        }
+        if (libssh2_userauth_authenticated(s->session)) {
+            return 0;
+        }
+    }
+    
+    if (opts->check || (!strstr(methods, "password") && !strstr(methods, "keyboard-interactive"))) {
+        fprintf(stderr, "%s@%s: Permission denied (%s).\n", opts->user, opts->host, methods);
+        return -1;
+    }
+    snprintf(prompt, sizeof(prompt), "%s@%s's password: ", opts->user, opts->host);
+    for (tries = 0, rc = -1; tries < 3 && rc != 0; tries++) {
+        if (read_password(prompt, password, sizeof(password)) != 0) {
+            break;
+        }
+        s->password = password;
+        if (strstr(methods, "password")) {
+            rc = libssh2_userauth_password_ex(s->session, opts->user, user_len,
+                                              password, (unsigned int)strlen(password), NULL);
+        }
+        if (rc != 0 && strstr(methods, "keyboard-interactive")) {
+            rc = libssh2_userauth_keyboard_interactive_ex(s->session, opts->user, user_len,
+                                                          native_kbd_reply);
+        }
+        s->password = NULL;
+        memset(password, 0, sizeof(password));
+        if (rc != 0) {
+            fprintf(stderr, "Permission denied, please try again.\n");
+        }
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+static void native_close(NativeSession *s) {
+    if (s->session) {
+        libssh2_session_disconnect(s->session, "done");
+        libssh2_session_free(s->session);
+        s->session = NULL;
+    }
+    if (s->sock != INVALID_SOCKET) {
+        close_socket(s->sock);
+        s->sock = INVALID_SOCKET;
+    }
+}
+
+/* Connect, check the host key and authenticate (see native_auth() for `key`) */
+static int native_open(const Options *opts, const char *key, NativeSession *s) {
+    KnownHosts kh;
+    int rc;
+    
+    s->sock = INVALID_SOCKET;
+    s->session = NULL;
+    s->password = NULL;
+    if (native_init() != 0) {
+        return NATIVE_UNAVAILABLE;
+    }
+    
+    rc = native_connect(opts, &s->sock);
+    if (rc != 0) {
+        return rc;
+    }
+    s->session = libssh2_session_init_ex(NULL, NULL, NULL, s);
+    if (!s->session || libssh2_session_handshake(s->session, s->sock) != 0) {
+        fprintf(stderr, "ssh: handshake with %s failed\n", opts->host);
+        native_close(s);
+        return SSH_CONNECT_FAILED;
+    }
+    known_hosts_load(s->session, &kh);
+    rc = native_check_host(&kh, s->session, opts, NULL);
+    known_hosts_free(&kh);
+    if (rc != 0 || native_auth(s, opts, key) != 0) {
+        native_close(s);
+        return SSH_CONNECT_FAILED;
+    }
+    return 0;
+}
+
+/*
+ * Run one command on an open session, feeding it `input`. Its stdout goes
+ * to `out`, or is passed through if that is NULL, and its stderr is passed
+ * through. Returns the remote exit status.
+ */
+static int native_exec(NativeSession *s, const char *remote_cmd,
+                       const char *input, size_t input_len, Buffer *out) {
+    LIBSSH2_CHANNEL *channel;
+    char chunk[4096];
+    ssize_t n;
+    int status;
+    
+    channel = libssh2_channel_open_session(s->session);
+    if (!channel) {
+        return SSH_CONNECT_FAILED;
+    }
+    if (libssh2_channel_exec(channel, remote_cmd) != 0) {
+        libssh2_channel_free(channel);
+        return SSH_CONNECT_FAILED;
+    }
+    while (input_len > 0) {
+        n = libssh2_channel_write(channel, input, input_len);
+        if (n < 0) {
+            /* The command stopped reading; its exit status says why */
+            break;
+        }
+        input += n;
+        input_len -= (size_t)n;
+    }
+    libssh2_channel_send_eof(channel);
+    
+    /* libssh2 queues both streams, so reading them in turn cannot stall */
+    while ((n = libssh2_channel_read(channel, chunk, sizeof(chunk))) > 0) {
+        if (out) {
+            buffer_append(out, chunk, (size_t)n);
+        } else {
+            fwrite(chunk, 1, (size_t)n, stdout);
+        }
+    }
+    while ((n = libssh2_channel_read_stderr(channel, chunk, sizeof(chunk))) > 0) {
+        fwrite(chunk, 1, (size_t)n, stderr);
+    }
+    fflush(stdout);
+    
+    libssh2_channel_close(channel);
+    libssh2_channel_wait_closed(channel);
+    status = libssh2_channel_get_exit_status(channel);
+    libssh2_channel_free(channel);
+    return status;
+}
+
+/*
+ * Session kept open for the host whose options are `native_shared_opts`
+ * until mux_close(): every later native_run() for it is one more channel,
+ * so a multi-step run logs in (and asks for a password) once. Holding it
+ * costs nothing, so the first command's session is kept, not only one
+ * opened by mux_open().
+ */
+static NativeSession native_shared = { INVALID_SOCKET, NULL, NULL };
+static const Options *native_shared_opts;
+
+static void native_unshare(void) {
+    native_close(&native_shared);
+    native_shared_opts = NULL;
+}
+
+static int native_share(const Options *opts) {
+    static int registered;
+    int rc;
+    
+    if (native_shared_opts == opts) {
+        return 0;
+    }
+    /* Runs before libssh2_exit(), which native_init() registered first */
+    if (!registered && native_init() == 0) {
+        atexit(native_unshare);
+        registered = 1;
+    }
+    native_unshare();
+    rc = native_open(opts, NULL, &native_shared);
+    if (rc == 0) {
+        native_shared_opts = opts;
+    }
+    return rc;
+}
+
+/*
+ * Run `remote_cmd` over the in-process transport, authenticating only
+ * with the private key `key` if it is not NULL, and collecting its stdout
+ * in `out` unless that is NULL. Returns the command's exit
+ * status, SSH_CONNECT_FAILED, or NATIVE_UNAVAILABLE when the ssh binary
+ * has to be used instead.
+ */
+int native_run(Options *opts, const char *key, const char *remote_cmd,
+               const char *input, size_t input_len, Buffer *out) {
+    NativeSession s;
+    int rc;
+    
+    if (!native_usable(opts)) {
+        return NATIVE_UNAVAILABLE;
+    }
+    if (!key && !opts->no_mux) {
+        rc = native_share(opts);
+        return rc == 0 ? native_exec(&native_shared, remote_cmd, input, input_len, out) : rc;
+    }
+    rc = native_open(opts, key, &s);
+    if (rc == 0) {
+        rc = native_exec(&s, remote_cmd, input, input_len, out);
+        native_close(&s);
+    }
+    return rc;
+}
+
+/* Read a password from the terminal without echo */
+int read_password(const char *prompt, char *buf, size_t size) {
+#ifdef _WIN32
+    size_t len = 0;
+    int c;
+    
+    fputs(prompt, stderr);
+    while ((c = _getch()) != '\r' && c != '\n') {
+        if (c == 3 || c == EOF) {
+            fputs("\n", stderr);
+            return -1;
+        }
+        if (c == '\b') {
+            if (len > 0) {
+                len--;
+            }
+        } else if (len + 1 < size) {
+            buf[len++] = (char)c;
+        }
+    }
+    buf[len] = '\0';
+    fputs("\n", stderr);
+    return 0;
+#else
+    struct termios saved;
+    struct termios silent;
+    FILE *tty = fopen("/dev/tty", "r+");
+    int ok;
+    
+    if (!tty) {
+        return -1;
+    }
+    fputs(prompt, tty);
+    fflush(tty);
+    tcgetattr(fileno(tty), &saved);
+    silent = saved;
+    silent.c_lflag &= ~(tcflag_t)ECHO;
+    tcsetattr(fileno(tty), TCSAFLUSH, &silent);
+    ok = fgets(buf, (int)size, tty) != NULL;
+    tcsetattr(fileno(tty), TCSAFLUSH, &saved);
+    fputs("\n", tty);
+    fclose(tty);
+    if (!ok) {
+        return -1;
+    }
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 0;
+#endif
+}
+
+/*
+ * Non-blocking engine for fleet runs.
+ * Every host is a state machine (connect, handshake, auth, exec, write,
+ * read, close) that is advanced whenever its socket is ready: with the
+ * session in non-blocking mode libssh2 returns LIBSSH2_ERROR_EAGAIN
+ * instead of waiting and tells which direction it waits for. One thread
+ * keeps thousands of logins in flight this way. Only agent keys and the
+ * default key files are tried, as nobody can answer a password prompt.
+ */
+#define NS_CONNECT      0
+#define NS_CONNECTING   1
+#define NS_HANDSHAKE    2
+#define NS_AUTH_LIST    3
+#define NS_AUTH_AGENT   4
+#define NS_AUTH_KEYFILE 5
+#define NS_CHANNEL      6
+#define NS_EXEC         7
+#define NS_WRITE        8
+#define NS_EOF          9
+#define NS_READ         10
+#define NS_CLOSE        11
+#define NS_CLOSED       12
+#define NS_DONE         13
+
+static void socket_prepare(socket_t sock) {
+#ifdef _WIN32
+    u_long on = 1;
+    
+    ioctlsocket(sock, FIONBIO, &on);
+#else
+    /* ssh children spawned for other hosts must not inherit it */
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+int native_engine_init(NativeEngine *engine) {
+    memset(engine, 0, sizeof(*engine));
+    if (native_init() != 0) {
+        return -1;
+    }
+    /* Never connected: it only owns the known_hosts list shared by all hosts */
+    engine->owner = libssh2_session_init();
+    if (!engine->owner) {
+        return -1;
+    }
+    known_hosts_load(engine->owner, &engine->known);
+    return 0;
+}
+
+void native_engine_free(NativeEngine *engine) {
+    known_hosts_free(&engine->known);
+    if (engine->owner) {
+        libssh2_session_free(engine->owner);
+        engine->owner = NULL;
+    }
+}
+
+/* Give up on a host; `message` (may be NULL) goes to its output */
+static void native_fail(NativeJob *job, const char *message) {
+    if (message) {
+        native_message(&job->err, "%s\n", message);
+    }
+    job->status = SSH_CONNECT_FAILED;
+    job->state = NS_DONE;
+}
+
+static void native_agent_done(NativeJob *job) {
+    if (job->agent) {
+        libssh2_agent_disconnect(job->agent);
+        libssh2_agent_free(job->agent);
+        job->agent = NULL;
+    }
+}
+
+/* Advance a job until it would block */
+static void native_step(NativeEngine *engine, NativeJob *job) {
+    struct libssh2_agent_publickey *identity;
+    const Options *opts = job->opts;
+    unsigned int user_len = (unsigned int)strlen(opts->user);
+    char private_key[MAX_PATH_LEN];
+    char public_key[MAX_PATH_LEN + 8];
+    char chunk[4096];
+    const char *methods;
+    const char *home;
+    socklen_t error_len;
+    ssize_t n;
+    int error;
+    int blocked;
+    int rc;
+    
+    for (;;) {
+        switch (job->state) {
+        case NS_CONNECT:
+            if (!job->addr) {
+                native_message(&job->err, "ssh: connect to host %s port %d failed\n",
+                               opts->host, opts->port > 0 ? opts->port : 22);
+                native_fail(job, NULL);
+                break;
+            }
+            job->sock = socket(job->addr->ai_family, job->addr->ai_socktype,
+                               job->addr->ai_protocol);
+            if (job->sock == INVALID_SOCKET) {
+                job->addr = job->addr->ai_next;
+                break;
+            }
+            socket_prepare(job->sock);
+            job->state = NS_CONNECTING;
+            if (connect(job->sock, job->addr->ai_addr, (int)job->addr->ai_addrlen) != 0) {
+                if (connect_pending()) {
+                    return;
+                }
+                close_socket(job->sock);
+                job->sock = INVALID_SOCKET;
+                job->addr = job->addr->ai_next;
+                job->state = NS_CONNECT;
+            }
+            break;
+        case NS_CONNECTING:
+            /* Writable: the connect finished, one way or the other */
+            error = 0;
+            error_len = sizeof(error);
+            if (getsockopt(job->sock, SOL_SOCKET, SO_ERROR, (char *)&error, &error_len) != 0 ||
+                error != 0) {
+                close_socket(job->sock);
+                job->sock = INVALID_SOCKET;
+                job->addr = job->addr->ai_next;
+                job->state = NS_CONNECT;
+                break;
+            }
+            job->session = libssh2_session_init_ex(NULL, NULL, NULL, job);
+            if (!job->session) {
+                native_fail(job, "ssh: out of memory");
+                break;
+            }
+            libssh2_session_set_blocking(job->session, 0);
+            job->state = NS_HANDSHAKE;
+            break;
+        case NS_HANDSHAKE:
+            rc = libssh2_session_handshake(job->session, job->sock);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            if (rc != 0) {
+                native_message(&job->err, "ssh: handshake with %s failed\n", opts->host);
+                native_fail(job, NULL);
+            } else if (native_check_host(&engine->known, job->session, opts, &job->err) != 0) {
+                native_fail(job, NULL);
+            } else {
+                job->state = NS_AUTH_LIST;
+            }
+            break;
+        case NS_AUTH_LIST:
+            methods = libssh2_userauth_list(job->session, opts->user, user_len);
+            if (!methods) {
+                if (libssh2_userauth_authenticated(job->session)) {
+                    job->state = NS_CHANNEL;
+                } else if (libssh2_session_last_errno(job->session) == LIBSSH2_ERROR_EAGAIN) {
+                    return;
+                } else {
+                    native_fail(job, "ssh: authentication failed");
+                }
+                break;
+            }
+            if (!strstr(methods, "publickey")) {
+                native_message(&job->err, "Permission denied (%s).\n", methods);
+                native_fail(job, NULL);
+                break;
+            }
+            /* The agent is local, so talking to it blocks only briefly */
+            job->agent = libssh2_agent_init(job->session);
+            if (job->agent && (libssh2_agent_connect(job->agent) != 0 ||
+                               libssh2_agent_list_identities(job->agent) != 0)) {
+                native_agent_done(job);
+            }
+            job->identity = NULL;
+            job->state = job->agent ? NS_AUTH_AGENT : NS_AUTH_KEYFILE;
+            break;
+        case NS_AUTH_AGENT:
+            if (!job->trying) {
+                if (libssh2_agent_get_identity(job->agent, &identity, job->identity) != 0) {
+                    native_agent_done(job);
+                    job->state = NS_AUTH_KEYFILE;
+                    break;
+                }
+                job->identity = identity;
+                job->trying = 1;
+            }
+            rc = libssh2_agent_userauth(job->agent, opts->user, job->identity);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            job->trying = 0;
+            if (rc == 0) {
+                native_agent_done(job);
+                job->state = NS_CHANNEL;
+            }
+            break;
+        case NS_AUTH_KEYFILE:
+            home = get_home_dir();
+            if (!home || !native_default_keys[job->key_index]) {
+                native_message(&job->err, "%s@%s: Permission denied (publickey).\n",
+                               opts->user, opts->host);
+                native_fail(job, NULL);
+                break;
+            }
+            if (snprintf(private_key, sizeof(private_key), "%s" PATH_SEP ".ssh" PATH_SEP "%s",
+                         home, native_default_keys[job->key_index]) >= (int)sizeof(private_key) ||
+                !file_exists(private_key)) {
+                job->key_index++;
+                break;
+            }
+            snprintf(public_key, sizeof(public_key), "%s.pub", private_key);
+            rc = libssh2_userauth_publickey_fromfile_ex(job->session, opts->user, user_len,
+                                                        public_key, private_key, NULL);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            if (rc == 0) {
+                job->state = NS_CHANNEL;
+            } else {
+                job->key_index++;
+            }
+            break;
+        case NS_CHANNEL:
+            job->channel = libssh2_channel_open_session(job->session);
+            if (!job->channel) {
+                if (libssh2_session_last_errno(job->session) == LIBSSH2_ERROR_EAGAIN) {
+                    return;
+                }
+                native_fail(job, "ssh: cannot open a session channel");
+                break;
+            }
+            job->state = NS_EXEC;
+            break;
+        case NS_EXEC:
+            rc = libssh2_channel_exec(job->channel, job->remote_cmd);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            if (rc != 0) {
+                native_fail(job, "ssh: the server refused to run the command");
+                break;
+            }
+            job->state = NS_WRITE;
+            break;
+        case NS_WRITE:
+            if (job->input_len == 0) {
+                job->state = NS_EOF;
+                break;
+            }
+            n = libssh2_channel_write(job->channel, job->input, job->input_len);
+            if (n == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            if (n < 0) {
+                /* The command stopped reading; its exit status says why */
+                job->state = NS_EOF;
+                break;
+            }
+            job->input += n;
+            job->input_len -= (size_t)n;
+            break;
+        case NS_EOF:
+            if (libssh2_channel_send_eof(job->channel) == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            job->state = NS_READ;
+            break;
+        case NS_READ:
+            n = libssh2_channel_read(job->channel, chunk, sizeof(chunk));
+            if (n > 0) {
+                buffer_append(&job->out, chunk, (size_t)n);
+                break;
+            }
+            blocked = n == LIBSSH2_ERROR_EAGAIN;
+            n = libssh2_channel_read_stderr(job->channel, chunk, sizeof(chunk));
+            if (n > 0) {
+                buffer_append(&job->err, chunk, (size_t)n);
+                break;
+            }
+            if (!libssh2_channel_eof(job->channel) && (blocked || n == LIBSSH2_ERROR_EAGAIN)) {
+                return;
+            }
+            job->state = NS_CLOSE;
+            break;
+        case NS_CLOSE:
+            if (libssh2_channel_close(job->channel) == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            job->state = NS_CLOSED;
+            break;
+        case NS_CLOSED:
+            if (libssh2_channel_wait_closed(job->channel) == LIBSSH2_ERROR_EAGAIN) {
+                return;
+            }
+            job->status = libssh2_channel_get_exit_status(job->channel);
+            job->state = NS_DONE;
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+/*
+ * Start running `remote_cmd` on the host with `input` on its stdin, its
+ * stdout going to `sink` (with `ctx`) if that is set; `opts` and `input`
+ * must stay valid until `done` has run. Returns
+ * NATIVE_UNAVAILABLE if the host has to go through the ssh binary.
+ */
+int native_start(NativeEngine *engine, const Options *opts, const char *remote_cmd,
+                 const char *input, size_t input_len, BufferSink sink,
+                 NativeDone done, void *ctx) {
+    struct addrinfo *addrs;
+    NativeJob *job;
+    
+    if (!engine->owner || !native_usable(opts)) {
+        return NATIVE_UNAVAILABLE;
+    }
+    addrs = native_resolve(opts);
+    if (!addrs) {
+        return NATIVE_UNAVAILABLE;
+    }
+    job = calloc(1, sizeof(NativeJob));
+    if (!job) {
+        freeaddrinfo(addrs);
+        return NATIVE_UNAVAILABLE;
+    }
+    job->opts = opts;
+    job->remote_cmd = remote_cmd;
+    job->input = input;
+    job->input_len = input_len;
+    job->state = NS_CONNECT;
+    job->sock = INVALID_SOCKET;
+    job->addrs = job->addr = addrs;
+    job->deadline = time(NULL) + NATIVE_LOGIN_TIMEOUT;
+    job->status = -1;
+    job->out.sink = sink;
+    job->out.sink_ctx = ctx;
+    job->done = done;
+    job->ctx = ctx;
+    job->next = engine->jobs;
+    engine->jobs = job;
+    engine->active++;
+    native_step(engine, job);
+    return 0;
+}
+
+/* Unlink a finished job, release its connection, run its callback */
+static void native_finish(NativeEngine *engine, NativeJob *job) {
+    NativeJob **link = &engine->jobs;
+    
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+    engine->active--;
+    
+    native_agent_done(job);
+    if (job->session && job->status != SSH_CONNECT_FAILED) {
+        libssh2_session_disconnect(job->session, "done");
+    }
+    /* With the socket gone the frees below cannot wait for the network */
+    if (job->sock != INVALID_SOCKET) {
+        close_socket(job->sock);
+    }
+    if (job->channel) {
+        libssh2_channel_free(job->channel);
+    }
+    if (job->session) {
+        libssh2_session_free(job->session);
+    }
+    freeaddrinfo(job->addrs);
+    job->done(job, job->ctx);
+    buffer_free(&job->out);
+    buffer_free(&job->err);
+    free(job);
+}
+
+/*
+ * Wait up to `timeout_ms` (-1: until something happens) for socket
+ * activity, advance the ready jobs and finish the completed ones.
+ */
+int native_run_once(NativeEngine *engine, int timeout_ms) {
+    struct pollfd *fds;
+    NativeJob **owners;
+    NativeJob *job;
+    NativeJob *next;
+    time_t now = time(NULL);
+    int directions;
+    int count = 0;
+    int i;
+    
+    fds = malloc(engine->active * sizeof(*fds) + 1);
+    owners = malloc(engine->active * sizeof(*owners) + 1);
+    if (!fds || !owners) {
+        free(fds);
+        free(owners);
+        return -1;
+    }
+    for (job = engine->jobs; job; job = job->next) {
+        if (job->state < NS_CHANNEL && now >= job->deadline) {
+            native_message(&job->err, "ssh: connection to %s timed out\n", job->opts->host);
+            native_fail(job, NULL);
+        }
+        if (job->state == NS_DONE) {
+            timeout_ms = 0;
+            continue;
+        }
+        fds[count].fd = job->sock;
+        if (job->state == NS_CONNECTING) {
+            fds[count].events = POLLOUT;
+        } else {
+            directions = libssh2_session_block_directions(job->session);
+            fds[count].events = 0;
+            if (directions & LIBSSH2_SESSION_BLOCK_INBOUND) {
+                fds[count].events |= POLLIN;
+            }
+            if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+                fds[count].events |= POLLOUT;
+            }
+            if (fds[count].events == 0) {
+                fds[count].events = POLLIN;
+            }
+        }
+        fds[count].revents = 0;
+        owners[count++] = job;
+    }
+    
+    /* Wake up at least once a second to enforce the login deadline */
+    if (timeout_ms < 0 || timeout_ms > 1000) {
+        timeout_ms = 1000;
+    }
+    if (count > 0 && poll_sockets(fds, count, timeout_ms) > 0) {
+        for (i = 0; i < count; i++) {
+            if (fds[i].revents) {
+                native_step(engine, owners[i]);
+            }
+        }
+    }
+    free(fds);
+    free(owners);
+    
+    for (job = engine->jobs; job; job = next) {
+        next = job->next;
+        if (job->state == NS_DONE) {
+            native_finish(engine, job);
+        }
+    }
+    return 0;
+}
+#endif
+
+#ifdef HAVE_CONTROL_MASTER
+/*
+ * Connection multiplexing.
+ * Each run gets its own private socket directory (mkdtemp, mode 0700), so
+ * concurrent runs never share a ControlPath. Open masters are registered
+ * with their teardown command and shut down by mux_close() or, on any
+ * exit() path, by the atexit handler. ControlPersist bounds the lifetime
+ * of a master we could not shut down (e.g. the process was killed).
+ */
+#define MUX_MAX_SESSIONS 64
+#define MUX_PERSIST_SECONDS 60
+
+typedef struct {
+    char control_path[MAX_PATH_LEN];
+    SshArgv exit_args;
+} MuxSession;
+
+static char mux_dir[MAX_PATH_LEN];
+static MuxSession *mux_sessions[MUX_MAX_SESSIONS];
+static int mux_counter;
+
+static void mux_shutdown(MuxSession *session) {
+    run_process(session->exit_args.argv, NULL, 0, CHILD_SILENT, NULL);
+    /* The master removes its socket; this only covers a master that died */
+    unlink(session->control_path);
+    free(session);
+}
+
+static void mux_cleanup(void) {
+    int i;
+    
+    for (i = 0; i < MUX_MAX_SESSIONS; i++) {
+        if (mux_sessions[i]) {
+            mux_shutdown(mux_sessions[i]);
+            mux_sessions[i] = NULL;
+        }
+    }
+    if (mux_dir[0] != '\0') {
+        rmdir(mux_dir);
+        mux_dir[0] = '\0';
+    }
+}
+
+static int mux_init_dir(void) {
+    const char *tmp;
+    
+    if (mux_dir[0] != '\0') {
+        return 0;
+    }
+    tmp = getenv("TMPDIR");
+    snprintf(mux_dir, sizeof(mux_dir), "%s/ssh-copy-id.XXXXXX",
+             tmp && tmp[0] ? tmp : "/tmp");
+    if (!mkdtemp(mux_dir)) {
+        mux_dir[0] = '\0';
+        return -1;
+    }
+    atexit(mux_cleanup);
+    return 0;
+}
+#endif
+
+/*
+ * Open one shared connection for this host: an in-process session when
+ * libssh2 can serve it, otherwise an OpenSSH master. Every later
+ * run_remote() for the host then runs as a channel over it instead of a
+ * full handshake. A master costs a process and a teardown, so callers
+ * only open one before a second command on the same host. Returns 0 when
+ * the connection is up or multiplexing is not available, otherwise the
+ * ssh exit code.
+ */
+int mux_open(Options *opts) {
+#ifdef HAVE_CONTROL_MASTER
+    static const char *const exit_extra[] = { "-O", "exit", NULL };
+    char persist[32];
+    const char *extra[] = { "-o", "ControlMaster=yes", "-o", persist, "-f", "-N", NULL };
+    SshArgv args;
+    MuxSession *session;
+    int slot;
+    int result;
+#endif
+    
+#ifdef USE_LIBSSH2
+    if (!opts->no_mux && native_usable(opts)) {
+        int rc = native_share(opts);
+        
+        return rc == NATIVE_UNAVAILABLE ? 0 : rc;
+    }
+#endif
+#ifdef HAVE_CONTROL_MASTER
+    if (opts->no_mux || opts->control_path[0] != '\0') {
+        return 0;
+    }
+    for (slot = 0; slot < MUX_MAX_SESSIONS && mux_sessions[slot]; slot++) {
+    }
+    if (slot == MUX_MAX_SESSIONS || mux_init_dir() != 0) {
+        return 0;
+    }
+    session = malloc(sizeof(MuxSession));
+    if (!session) {
+        return 0;
+    }
+    
+    /* Short names keep the socket well under the sun_path limit */
+    snprintf(opts->control_path, sizeof(opts->control_path), "%s/cm-%d",
+             mux_dir, mux_counter++);
+    snprintf(persist, sizeof(persist), "ControlPersist=%d", MUX_PERSIST_SECONDS);
+    build_ssh_argv(opts, extra, NULL, &args);
+    
+    result = run_process(args.argv, NULL, 0, CHILD_INHERIT, NULL);
+    if (result != 0) {
+        opts->control_path[0] = '\0';
+        free(session);
+        return result;
+    }
+    
+    build_ssh_argv(opts, exit_extra, NULL, &session->exit_args);
+    strcpy(session->control_path, opts->control_path);
+    mux_sessions[slot] = session;
+    return 0;
+#else
+    (void)opts;
+    return 0;
+#endif
+}
+
+/* Shut down the shared connection opened by mux_open() */
+void mux_close(Options *opts) {
+#ifdef HAVE_CONTROL_MASTER
+    int i;
+#endif
+    
+#ifdef USE_LIBSSH2
+    if (native_shared_opts == opts) {
+        native_unshare();
+    }
+#endif
+#ifdef HAVE_CONTROL_MASTER
+    if (opts->control_path[0] == '\0') {
+        return;
+    }
+    for (i = 0; i < MUX_MAX_SESSIONS; i++) {
+        if (mux_sessions[i] &&
+            strcmp(mux_sessions[i]->control_path, opts->control_path) == 0) {
+            mux_shutdown(mux_sessions[i]);
+            mux_sessions[i] = NULL;
+        }
+    }
+    opts->control_path[0] = '\0';
+#else
+    (void)opts;
+#endif
+}
+
+/*
+ * Provisioning state cache (~/.ssh/ssh-copy-id.state).
+ * Each confirmed install is one fixed-size record keyed by the SHA-256 of
+ * user, host, port and key fingerprint, holding the time and the size and
+ * cksum of the remote authorized_keys. Records are only ever appended and
+ * the newest one per id wins, so an interrupted write or compaction never
+ * loses a newer state. Every access holds an exclusive lock on the file
+ * (fcntl, LockFileEx), which makes it safe to share between runs.
+ */
+#define STATE_FILE "ssh-copy-id.state"
+#define STATE_MAGIC "sci1"
+#define STATE_RECORD_SIZE 64
+/* Rewrite the file once it is this long and mostly superseded records */
+#define STATE_COMPACT_MIN 4096
+
+static int state_lock(StateCache *cache, int lock) {
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(cache->fp));
+    OVERLAPPED ov;
+    
+    memset(&ov, 0, sizeof(ov));
+    if (lock) {
+        return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ov) ? 0 : -1;
+    }
+    return UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &ov) ? 0 : -1;
+#else
+    struct flock fl;
+    
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = lock ? F_WRLCK : F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fileno(cache->fp), F_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+#endif
+}
+
+/* Records are stored little-endian whatever the host order */
+static void put_le(unsigned char *p, unsigned long long value, int bytes) {
+    int i;
+    
+    for (i = 0; i < bytes; i++) {
+        p[i] = (unsigned char)(value >> (i * 8));
+    }
+}
+
+static unsigned long long get_le(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+    int i;
+    
+    for (i = bytes - 1; i >= 0; i--) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+/* magic[4] id[32] confirmed[8] size[8] cksum[4] reserved[8] */
+static void state_encode(const StateRecord *rec, unsigned char *raw) {
+    memset(raw, 0, STATE_RECORD_SIZE);
+    memcpy(raw, STATE_MAGIC, 4);
+    memcpy(raw + 4, rec->id, SHA256_LEN);
+    put_le(raw + 36, rec->confirmed, 8);
+    put_le(raw + 44, rec->size, 8);
+    put_le(raw + 52, rec->cksum, 4);
+}
+
+static int state_decode(const unsigned char *raw, StateRecord *rec) {
+    if (memcmp(raw, STATE_MAGIC, 4) != 0) {
+        return -1;
+    }
+    memcpy(rec->id, raw + 4, SHA256_LEN);
+    rec->confirmed = get_le(raw + 36, 8);
+    rec->size = get_le(raw + 44, 8);
+    rec->cksum = (unsigned long)get_le(raw + 52, 4);
+    return 0;
+}
+
+/* The record for `id`, adding an empty one if `add` is set */
+static StateRecord *state_slot(StateCache *cache, const unsigned char *id, int add) {
+    StateRecord *records;
+    size_t capacity;
+    size_t index;
+    int rc;
+    
+    if (!add) {
+        return fpset_find(&cache->ids, id, &index) ? &cache->records[index] : NULL;
+    }
+    if (cache->ids.count == cache->capacity) {
+        capacity = cache->capacity ? cache->capacity * 2 : 256;
+        records = realloc(cache->records, capacity * sizeof(StateRecord));
+        if (!records) {
+            return NULL;
+        }
+        cache->records = records;
+        cache->capacity = capacity;
+    }
+    rc = fpset_add(&cache->ids, id, &index);
+    if (rc < 0) {
+        return NULL;
+    }
+    if (rc > 0) {
+        memset(&cache->records[index], 0, sizeof(StateRecord));
+        memcpy(cache->records[index].id, id, SHA256_LEN);
+    }
+    return &cache->records[index];
+}
+
+/* Rewrite the file with one record per id; the caller holds the lock */
+static void state_compact(StateCache *cache) {
+    unsigned char raw[STATE_RECORD_SIZE];
+    size_t i;
+    
+    if (fseek(cache->fp, 0, SEEK_SET) != 0) {
+        return;
+    }
+    for (i = 0; i < cache->ids.count; i++) {
+        state_encode(&cache->records[i], raw);
+        if (fwrite(raw, 1, sizeof(raw), cache->fp) != sizeof(raw)) {
+            return;
+        }
+    }
+    if (fflush(cache->fp) != 0) {
+        return;
+    }
+#ifdef _WIN32
+    _chsize_s(_fileno(cache->fp), (long long)cache->ids.count * STATE_RECORD_SIZE);
+#else
+    if (ftruncate(fileno(cache->fp), (off_t)cache->ids.count * STATE_RECORD_SIZE) != 0) {
+        return;
+    }
+#endif
+}
+
+/* Open the state file and index it. Returns -1 if there is none to use */
+int state_open(StateCache *cache) {
+    char path[MAX_PATH_LEN];
+    unsigned char raw[STATE_RECORD_SIZE];
+    const char *home = get_home_dir();
+    StateRecord rec;
+    StateRecord *slot;
+    unsigned long total = 0;
+    int fd;
+    
+    memset(cache, 0, sizeof(*cache));
+    /* Only where ssh keeps its own files; the directory is not created */
+    if (!home || snprintf(path, sizeof(path), "%s" PATH_SEP ".ssh", home) >= (int)sizeof(path) ||
+        !file_exists(path) ||
+        snprintf(path, sizeof(path), "%s" PATH_SEP ".ssh" PATH_SEP STATE_FILE,
+                 home) >= (int)sizeof(path)) {
+        return -1;
+    }
+#ifdef _WIN32
+    fd = _open(path, _O_RDWR | _O_CREAT | _O_BINARY | _O_NOINHERIT, _S_IREAD | _S_IWRITE);
+    cache->fp = fd >= 0 ? _fdopen(fd, "r+b") : NULL;
+    if (!cache->fp && fd >= 0) {
+        _close(fd);
+    }
+#else
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    cache->fp = fd >= 0 ? fdopen(fd, "r+b") : NULL;
+    if (!cache->fp && fd >= 0) {
+        close(fd);
+    }
+#endif
+    if (!cache->fp) {
+        return -1;
+    }
+    if (state_lock(cache, 1) != 0) {
+        state_close(cache);
+        return -1;
+    }
+    
+    while (fread(raw, 1, sizeof(raw), cache->fp) == sizeof(raw)) {
+        total++;
+        if (state_decode(raw, &rec) == 0 && (slot = state_slot(cache, rec.id, 1)) &&
+            rec.confirmed >= slot->confirmed) {
+            *slot = rec;
+        }
+    }
+    if (total >= STATE_COMPACT_MIN && total > cache->ids.count * 2) {
+        state_compact(cache);
+    }
+    state_lock(cache, 0);
+    return 0;
+}
+
+void state_close(StateCache *cache) {
+    if (cache->fp) {
+        fclose(cache->fp);
+    }
+    fpset_free(&cache->ids);
+    free(cache->records);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* The newest record for `id`, or NULL */
+const StateRecord *state_find(StateCache *cache, const unsigned char id[SHA256_LEN]) {
+    return state_slot(cache, id, 0);
+}
+
+static void state_id_host(Sha256 *ctx, const Options *opts) {
+    char port[16];
+    
+    snprintf(port, sizeof(port), "%d", opts->port);
+    sha256_init(ctx);
+    sha256_update(ctx, opts->user, strlen(opts->user) + 1);
+    sha256_update(ctx, opts->host, strlen(opts->host) + 1);
+    sha256_update(ctx, port, strlen(port) + 1);
+}
+
+/*
+ * The id of the record saying when keys were last removed from the host
+ * in `opts`. It has no fingerprint, so it cannot collide with an install.
+ */
+static void state_removal_id(const Options *opts, unsigned char id[SHA256_LEN]) {
+    Sha256 ctx;
+    
+    state_id_host(&ctx, opts);
+    sha256_update(&ctx, "removed", 8);
+    sha256_final(&ctx, id);
+}
+
+/*
+ * state_find() for the host in `opts`, ignoring a record that is not newer
+ * than the last --remove there: the key it vouches for may be gone.
+ */
+const StateRecord *state_lookup(StateCache *cache, const Options *opts,
+                                const unsigned char id[SHA256_LEN]) {
+    unsigned char removal_id[SHA256_LEN];
+    const StateRecord *rec = state_find(cache, id);
+    const StateRecord *removal;
+    
+    if (!rec) {
+        return NULL;
+    }
+    state_removal_id(opts, removal_id);
+    removal = state_find(cache, removal_id);
+    return removal && removal->confirmed >= rec->confirmed ? NULL : rec;
+}
+
+/* Append `rec` to the state file */
+int state_store(StateCache *cache, const StateRecord *rec) {
+    unsigned char raw[STATE_RECORD_SIZE];
+    StateRecord *slot;
+    long end;
+    int result = -1;
+    
+    if (!cache->fp) {
+        return -1;
+    }
+    slot = state_slot(cache, rec->id, 1);
+    if (slot) {
+        *slot = *rec;
+    }
+    
+    state_encode(rec, raw);
+    if (state_lock(cache, 1) != 0) {
+        return -1;
+    }
+    /* Write over the torn tail a killed writer may have left */
+    if (fseek(cache->fp, 0, SEEK_END) == 0 && (end = ftell(cache->fp)) >= 0 &&
+        fseek(cache->fp, end - end % STATE_RECORD_SIZE, SEEK_SET) == 0 &&
+        fwrite(raw, 1, sizeof(raw), cache->fp) == sizeof(raw) && fflush(cache->fp) == 0) {
+        result = 0;
+    }
+    state_lock(cache, 0);
+    return result;
+}
+
+/*
+ * The cache key of `fingerprint` on the host in `opts`. A --sync record
+ * vouches for the managed block, not just for the keys being somewhere in
+ * the file, so it gets a key of its own.
+ */
+void state_id(const Options *opts, const unsigned char fingerprint[SHA256_LEN],
+              unsigned char id[SHA256_LEN]) {
+    Sha256 ctx;
+    
+    state_id_host(&ctx, opts);
+    sha256_update(&ctx, fingerprint, SHA256_LEN);
+    if (opts->sync) {
+        sha256_update(&ctx, "sync", 5);
+    }
+    sha256_final(&ctx, id);
+}
+
+/*
+ * Record a confirmed install, with the "authorized_keys <cksum> <size>"
+ * line the install script printed on stdout if there is one.
+ */
+void state_confirm(StateCache *cache, const unsigned char id[SHA256_LEN], const Buffer *out) {
+    StateRecord rec;
+    const char *p = out->data;
+    unsigned long cksum;
+    unsigned long long size;
+    
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.id, id, SHA256_LEN);
+    rec.confirmed = (unsigned long long)time(NULL);
+    while (p && *p) {
+        if (sscanf(p, "authorized_keys %lu %llu", &cksum, &size) == 2) {
+            rec.cksum = cksum;
+            rec.size = size;
+            break;
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
+        }
+    }
+    state_store(cache, &rec);
+}
+
+/*
+ * Record that keys were removed from the host in `opts` at `when`. Records
+ * confirmed in that second or earlier no longer count, so a caller that
+ * confirms the host right after the removal passes a second earlier.
+ */
+void state_forget_host(StateCache *cache, const Options *opts, time_t when) {
+    StateRecord rec;
+    
+    memset(&rec, 0, sizeof(rec));
+    state_removal_id(opts, rec.id);
+    rec.confirmed = (unsigned long long)when;
+    state_store(cache, &rec);
+}
+
+/*
+ * Remote install script. The keys arrive on stdin, one per line; awk loads
+ * the blobs already in authorized_keys into a hash and appends only lines
+ * whose blob is new, matching whole fields so differing comments or
+ * options still count as present. The exit code is one of INSTALL_*; on
+ * success the size and cksum of the result go to stdout for the state cache.
+ */
+#define SCRIPT_PREPARE \
+    "umask 077; mkdir -p ~/.ssh && chmod 700 ~/.ssh && cd ~/.ssh || exit 11; " \
+    "touch authorized_keys || exit 12; " \
+    "[ -s authorized_keys ] && [ $(tail -c 1 authorized_keys | wc -l) -eq 0 ] && echo >> authorized_keys; "
+#define SCRIPT_FINISH \
+    "r=$?; chmod 600 authorized_keys || exit 12; " \
+    "case $r in 0|10) echo \"authorized_keys $(cksum < authorized_keys)\"; exit $r;; esac; exit 12"
+/*
+ * awk: key(l) is the base64 blob of an authorized_keys line, ignoring a
+ * trailing CR, or "" for a comment or a line without one, so the scripts
+ * count the same lines as keys as the KeyParser does here.
+ */
+#define AWK_KEY \
+    "function blob(n, a,  i) { for (i = 1; i <= n; i++) if (a[i] ~ /^AAAA[0-9A-Za-z+\\/=]+$/) return a[i]; return \"\" } " \
+    "function key(l,  a, n) { sub(/\\r$/, \"\", l); if (l ~ /^[ \\t]*#/) return \"\"; n = split(l, a); return blob(n, a) } "
+
+static const char INSTALL_SCRIPT[] =
+    "command -v awk > /dev/null 2>&1 || exit 13; "
+    SCRIPT_PREPARE
+    "awk -v force=%d -v f=authorized_keys '"
+    AWK_KEY
+    "BEGIN { if (!force) while ((getline l < f) > 0) if ((k = key(l)) != \"\") have[k] = 1 } "
+    "NF == 0 { next } "
+    "{ k = key($0); if (k != \"\" && (k in have)) next; if (k != \"\") have[k] = 1; print; added++ } "
+    "END { exit added ? 0 : 10 }' >> authorized_keys; "
+    SCRIPT_FINISH;
+
+/*
+ * Without awk on the server the check moves here: FETCH_SCRIPT streams
+ * authorized_keys back, it is scanned as it arrives, and APPEND_SCRIPT
+ * appends just the keys that were missing.
+ */
+static const char FETCH_SCRIPT[] =
+    "cat ~/.ssh/authorized_keys 2> /dev/null; exit 0";
+
+static const char APPEND_SCRIPT[] =
+    SCRIPT_PREPARE
+    "cat >> authorized_keys; "
+    SCRIPT_FINISH;
+
+/*
+ * --sync: the keys between these markers belong to us and are replaced as
+ * a whole. The first awk prints the current block; if its cksum is the one
+ * expected (the %s) nothing is written. Otherwise the new block arrives on
+ * stdin and the file is rebuilt into a temporary file that is renamed over
+ * authorized_keys, so sshd never sees half of it. A line outside the block
+ * holding one of the new keys is moved into it, so that dropping the key
+ * later really revokes it; other lines outside are never touched. The old
+ * block and the moved lines go to stdout so the caller can tell what was
+ * added and removed, and "kept <blob>" names each key dropped from the
+ * block that is still trusted by a line outside it. A BEGIN without END
+ * is not trusted and its lines are kept as they are.
+ */
+#define MANAGED_BEGIN "# BEGIN ssh-copy-id managed keys"
+#define MANAGED_END   "# END ssh-copy-id managed keys"
+
+static const char SYNC_SCRIPT[] =
+    "command -v awk > /dev/null 2>&1 || exit 13; "
+    SCRIPT_PREPARE
+    "b='" MANAGED_BEGIN "'; e='" MANAGED_END "'; "
+    "m=$(awk -v b=\"$b\" -v e=\"$e\" '$0 == e { m = 0 } m { print } $0 == b { m = 1 }' "
+    "authorized_keys | cksum); "
+    "[ \"$m\" = '%s' ] && { echo \"authorized_keys $(cksum < authorized_keys)\"; exit 20; }; "
+    "t=authorized_keys.sync.$$; cat > $t.new && "
+    "awk -v b=\"$b\" -v e=\"$e\" -v new=$t.new -v t=$t '"
+    AWK_KEY
+    "FILENAME == new { keys[++nk] = $0; if ((k = key($0)) != \"\") want[k] = 1; next } "
+    "!m && $0 == b { m = 1; np = 0; next } "
+    "m && $0 == e { m = 0; for (i = 1; i <= np; i++) { print old[i]; gone[key(old[i])] = 1 }; next } "
+    "m { old[++np] = $0; next } "
+    "{ k = key($0) } "
+    "k != \"\" && (k in want) { print; next } "
+    "k != \"\" { outside[k] = 1 } "
+    "{ print > t } "
+    "END { for (i = 1; m && i <= np; i++) print old[i] > t; "
+    "print b > t; for (i = 1; i <= nk; i++) print keys[i] > t; print e > t; "
+    "for (k in gone) if (k != \"\" && !(k in want) && (k in outside)) print \"kept\", k }' "
+    "$t.new authorized_keys && chmod 600 $t && mv -f $t authorized_keys; "
+    "r=$?; rm -f $t.new $t; [ $r -eq 0 ] || exit 12; "
+    "echo \"authorized_keys $(cksum < authorized_keys)\"";
+
+/*
+ * --remove: the keys arrive on stdin, one per line (a bare blob will do),
+ * and every line of authorized_keys holding one of them is dropped, so the
+ * file is rewritten once however many keys go. As with --sync the result
+ * is written to a temporary file and renamed into place. "removed N" goes
+ * to stdout; if no line matched nothing is written (REMOVE_NOT_FOUND).
+ */
+static const char REMOVE_SCRIPT[] =
+    "command -v awk > /dev/null 2>&1 || exit 13; "
+    "cd ~/.ssh 2> /dev/null && [ -f authorized_keys ] || exit 22; "
+    "umask 077; t=authorized_keys.remove.$$; cat > $t.del && : > $t && "
+    "awk -v del=$t.del -v t=$t '"
+    AWK_KEY
+    "{ k = key($0) } "
+    "FILENAME == del { if (k != \"\") gone[k] = 1; next } "
+    "k != \"\" && (k in gone) { removed++; next } "
+    "{ print > t } "
+    "END { print \"removed\", removed + 0; exit removed ? 0 : 22 }' "
+    "$t.del authorized_keys && chmod 600 $t && mv -f $t authorized_keys; "
+    "r=$?; rm -f $t.del $t; "
+    "case $r in 0|22) echo \"authorized_keys $(cksum < authorized_keys)\"; exit $r;; esac; exit 12";
+
+/*
+ * --rotate: stdin holds the old keys, ROTATE_MARKER and the new keys. One
+ * awk pass drops the old keys and appends the new ones that are missing
+ * into a temporary file, which is renamed over authorized_keys. The rename
+ * is the only change, so an interrupted run leaves the old file, never one
+ * without either key. key() skips commented lines, so a commented-out
+ * copy of a new key counts as absent and the new key is appended: every
+ * new key ends up active. "rotated <added> <removed>" goes to stdout; if
+ * the file was right already nothing is written (INSTALL_PRESENT).
+ */
+static const char ROTATE_SCRIPT[] =
+    "command -v awk > /dev/null 2>&1 || exit 13; "
+    "umask 077; mkdir -p ~/.ssh && chmod 700 ~/.ssh && cd ~/.ssh || exit 11; "
+    "touch authorized_keys || exit 12; "
+    "t=authorized_keys.rotate.$$; cat > $t.in && : > $t && "
+    "awk -v src=$t.in -v t=$t -v m='" ROTATE_MARKER "' '"
+    AWK_KEY
+    "{ k = key($0) } "
+    "FILENAME == src && $0 == m { new = 1; next } "
+    "FILENAME == src && !new { if (k != \"\") gone[k] = 1; next } "
+    "FILENAME == src { if (k != \"\") { delete gone[k]; add[++na] = $0; ak[na] = k }; next } "
+    "k != \"\" && (k in gone) { removed++; next } "
+    "k != \"\" { have[k] = 1 } "
+    "{ print > t } "
+    "END { if (!na) exit 2; "
+    "for (i = 1; i <= na; i++) if (!(ak[i] in have)) { have[ak[i]] = 1; print add[i] > t; added++ } "
+    "print \"rotated\", added + 0, removed + 0; exit (added || removed) ? 0 : 10 }' "
+    "$t.in authorized_keys && chmod 600 $t && mv -f $t authorized_keys; "
+    "r=$?; rm -f $t.in $t; "
+    "case $r in 0|10) echo \"authorized_keys $(cksum < authorized_keys)\"; exit $r;; esac; exit 12";
+
+/*
+ * --check: the keys arrive on stdin and one awk pass over authorized_keys
+ * looks for them, stopping at the first line that completes the set.
+ * Nothing is written and nothing is sent back but "missing N". Exits with
+ * INSTALL_PRESENT if every key is there, otherwise CHECK_MISSING (without
+ * that line if there is no authorized_keys at all).
+ */
+static const char CHECK_SCRIPT[] =
+    "command -v awk > /dev/null 2>&1 || exit 13; "
+    "[ -f ~/.ssh/authorized_keys ] || exit 23; "
+    "awk '"
+    AWK_KEY
+    "{ k = key($0) } "
+    "NR == FNR { if (k != \"\" && !(k in want)) { want[k] = 1; nw++ }; next } "
+    "(k in want) && !(k in found) { found[k] = 1; if (++nf == nw) exit } "
+    "END { print \"missing\", nw - nf; exit nf == nw ? 10 : 23 }' - ~/.ssh/authorized_keys";
+
+/* Run `remote_cmd` on the host, in-process if possible */
+static int run_remote(Options *opts, const char *remote_cmd, const char *input,
+                      size_t input_len, Buffer *out) {
+#ifdef USE_LIBSSH2
+    int result = native_run(opts, NULL, remote_cmd, input, input_len, out);
+    
+    if (result != NATIVE_UNAVAILABLE) {
+        return result;
+    }
+#endif
+    return run_ssh_command_input(opts, remote_cmd, input, input_len, out);
+}
+
+/* KeyStream callback: add the fingerprint of each key line to an FpSet */
+void fpset_collect(const KeyLine *key, void *ctx) {
+    unsigned char fingerprint[SHA256_LEN];
+    
+    if (key->kind == KEYLINE_KEY && blob_fingerprint(key->blob, fingerprint) == 0) {
+        fpset_add(ctx, fingerprint, NULL);
+    }
+}
+
+/* KeyStream callback: add the blob of each line whose key is wanted */
+void keys_match(const KeyLine *key, void *ctx) {
+    unsigned char fingerprint[SHA256_LEN];
+    KeyMatch *match = ctx;
+    
+    if (key->kind == KEYLINE_KEY && blob_fingerprint(key->blob, fingerprint) == 0 &&
+        fpset_find(match->wanted, fingerprint, NULL)) {
+        buffer_append(match->lines, key->blob.ptr, key->blob.len);
+        buffer_append(match->lines, "\n", 1);
+    }
+}
+
+/*
+ * Append to `payload` each key of key_content whose fingerprint is not in
+ * `have`, adding it there. Returns the number of keys appended.
+ */
+int keys_missing(const char *key_content, FpSet *have, Buffer *payload) {
+    unsigned char fingerprint[SHA256_LEN];
+    KeyParser parser;
+    KeyLine key;
+    StrView text;
+    int count = 0;
+    
+    keys_init(&parser, key_content, strlen(key_content));
+    while (keys_next(&parser, &key)) {
+        if (key.kind != KEYLINE_KEY || blob_fingerprint(key.blob, fingerprint) != 0 ||
+            fpset_add(have, fingerprint, NULL) == 0) {
+            continue;
+        }
+        text = key_text(&key);
+        buffer_append(payload, text.ptr, text.len);
+        buffer_append(payload, "\n", 1);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * install_key() for a server without awk. The fetch and the append are
+ * two commands, so they share one connection (see mux_open()).
+ */
+static int install_key_fallback(Options *opts, const char *key_content, Buffer *out) {
+    KeyStream stream;
+    FpSet have;
+    Buffer remote = { NULL, 0, 0, keystream_feed, NULL };
+    Buffer payload = { NULL, 0, 0, NULL, NULL };
+    double started;
+    int result = 0;
+    
+    memset(&have, 0, sizeof(have));
+    if (!opts->force) {
+        started = timing_start();
+        result = mux_open(opts);
+        timing_end(PHASE_CONNECT, started);
+    }
+    if (result == 0 && !opts->force) {
+        started = timing_start();
+        keystream_init(&stream, fpset_collect, &have);
+        remote.sink_ctx = &stream;
+        result = run_remote(opts, FETCH_SCRIPT, NULL, 0, &remote);
+        keystream_end(&stream);
+        timing_end(PHASE_FETCH, started);
+    }
+    if (result == 0 && keys_missing(key_content, &have, &payload) == 0) {
+        result = INSTALL_PRESENT;
+    } else if (result == 0) {
+        started = timing_start();
+        result = run_remote(opts, APPEND_SCRIPT, payload.data, payload.len, out);
+        timing_end(PHASE_APPEND, started);
+    }
+    buffer_free(&payload);
+    fpset_free(&have);
+    return result;
+}
+
+/* Feed bytes to the CRC of POSIX cksum(1) */
+static uint32_t cksum_update(uint32_t crc, const char *data, size_t len) {
+    size_t i;
+    int bit;
+    
+    for (i = 0; i < len; i++) {
+        crc ^= (uint32_t)(unsigned char)data[i] << 24;
+        for (bit = 0; bit < 8; bit++) {
+            crc = crc & 0x80000000u ? (crc << 1) ^ 0x04C11DB7u : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/* The value cksum(1) prints: the length goes in too, low byte first */
+static unsigned long cksum_final(uint32_t crc, size_t len) {
+    char c;
+    
+    for (; len > 0; len >>= 8) {
+        c = (char)(len & 0xFF);
+        crc = cksum_update(crc, &c, 1);
+    }
+    return (unsigned long)(~crc & 0xFFFFFFFFu);
+}
+
+/*
+ * Start of a remote script that ends it at once with INSTALL_UNCHANGED if
+ * authorized_keys still has the size and cksum recorded when `known` was
+ * confirmed. The keys (or the managed block) are then as they were, and
+ * the file need not be read by awk, let alone sent back. Empty if the
+ * record has no digest.
+ */
+static void unchanged_check(const StateRecord *known, char *check, size_t size) {
+    check[0] = '\0';
+    if (known && known->size > 0) {
+        snprintf(check, size,
+                 "c=$(cksum < ~/.ssh/authorized_keys 2> /dev/null); "
+                 "[ \"$c\" = '%lu %llu' ] && { echo \"authorized_keys $c\"; exit %d; }; ",
+                 known->cksum, known->size, INSTALL_UNCHANGED);
+    }
+}
+
+/*
+ * The remote script for key_content: the plain install, or with --sync
+ * the block rewrite, given the cksum the managed block has when it already
+ * holds exactly these keys (one per line, as key_dedup() left them).
+ * -f skips that comparison and always rewrites. With a `known` record the
+ * unchanged_check() goes first. --remove, --rotate and --check have
+ * scripts of their own.
+ */
+void install_script(const Options *opts, const char *key_content, const StateRecord *known,
+                    char *script, size_t size) {
+    char expected[48] = "";
+    size_t len = strlen(key_content);
+    size_t used;
+    uint32_t crc;
+    
+    if (opts->remove || opts->rotate || opts->check) {
+        snprintf(script, size, "%s", opts->remove ? REMOVE_SCRIPT
+                                     : opts->rotate ? ROTATE_SCRIPT : CHECK_SCRIPT);
+        return;
+    }
+    unchanged_check(known, script, size);
+    used = strlen(script);
+    script += used;
+    size -= used;
+    if (!opts->sync) {
+        snprintf(script, size, INSTALL_SCRIPT, opts->force ? 1 : 0);
+        return;
+    }
+    if (!opts->force) {
+        /* awk ends the last line with a newline even if the input did not */
+        crc = cksum_update(0, key_content, len);
+        if (len > 0 && key_content[len - 1] != '\n') {
+            crc = cksum_update(crc, "\n", 1);
+            len++;
+        }
+        snprintf(expected, sizeof(expected), "%lu %lu", cksum_final(crc, len), (unsigned long)len);
+    }
+    snprintf(script, size, SYNC_SCRIPT, expected);
+}
+
+/*
+ * Count the keys of key_content that a sync added and those it removed,
+ * from the old managed block the sync script printed to `out`. Keys that
+ * left the block but are still trusted outside it ("kept") are counted in
+ * *kept rather than *removed.
+ */
+void sync_diff(const char *key_content, const Buffer *out, int *added, int *removed, int *kept) {
+    unsigned char fingerprint[SHA256_LEN];
+    KeyParser parser;
+    KeyLine key;
+    FpSet want;
+    FpSet old;
+    
+    memset(&want, 0, sizeof(want));
+    memset(&old, 0, sizeof(old));
+    *added = 0;
+    *removed = 0;
+    *kept = 0;
+    keys_init(&parser, out->data ? out->data : "", out->len);
+    while (keys_next(&parser, &key)) {
+        if (key.kind != KEYLINE_KEY || blob_fingerprint(key.blob, fingerprint) != 0) {
+            continue;
+        }
+        if (key.type.len == 4 && memcmp(key.type.ptr, "kept", 4) == 0) {
+            (*kept)++;
+        } else {
+            fpset_add(&old, fingerprint, NULL);
+        }
+    }
+    keys_init(&parser, key_content, strlen(key_content));
+    while (keys_next(&parser, &key)) {
+        if (key.kind == KEYLINE_KEY && blob_fingerprint(key.blob, fingerprint) == 0 &&
+            fpset_add(&want, fingerprint, NULL) == 1 && !fpset_find(&old, fingerprint, NULL)) {
+            (*added)++;
+        }
+    }
+    *removed = (int)old.count - ((int)want.count - *added) - *kept;
+    fpset_free(&want);
+    fpset_free(&old);
+}
+
+/*
+ * Install the key on the server.
+ * The whole install (mkdir, presence check, append, chmod) runs as one
+ * remote script over a single ssh login and the key is streamed to it on
+ * stdin; only a server without awk needs more than that one command.
+ * Its stdout is collected in `out`. `known` is the state record of the
+ * last confirmed install there, if any. Returns one of the INSTALL_*
+ * values, or 255 if ssh itself failed to connect.
+ */
+int install_key(Options *opts, const char *key_content, const StateRecord *known, Buffer *out) {
+    char script[MAX_CMD_LEN];
+    double started = timing_start();
+    int result;
+    
+    install_script(opts, key_content, known, script, sizeof(script));
+    result = run_remote(opts, script, key_content, strlen(key_content), out);
+    timing_end(PHASE_SCRIPT, started);
+    /* Rewriting the managed block needs awk; there is no fallback for it */
+    if (result == INSTALL_NO_AWK && !opts->sync) {
+        result = install_key_fallback(opts, key_content, out);
+    }
+    return result;
+}
+
+/* Describe an install_key() result */
+const char *install_status_text(int status) {
+    switch (status) {
+    case INSTALL_ADDED:
+        return "key added";
+    case INSTALL_PRESENT:
+        return "key already present";
+    case INSTALL_CACHED:
+        return "key already present (cached)";
+    case SYNC_UNCHANGED:
+        return "managed keys in sync";
+    case INSTALL_UNCHANGED:
+        return "authorized_keys unchanged since last confirmed";
+    case REMOVE_NOT_FOUND:
+        return "key not present";
+    case CHECK_MISSING:
+        return "key missing";
+    case INSTALL_NO_SSH_DIR:
+        return "failed to create ~/.ssh directory";
+    case INSTALL_WRITE_FAILED:
+        return "failed to write ~/.ssh/authorized_keys";
+    case INSTALL_NO_AWK:
+        return "no awk on server";
+    case SSH_CONNECT_FAILED:
+        return "connection failed";
+    default:
+        return "ssh failed";
+    }
+}
+
+/*
+ * Copy key to server, unless the state cache already saw it installed
+ * there (INSTALL_CACHED). Returns 0 on success, INSTALL_UNCHANGED if the
+ * server's file was as last confirmed, or the failing INSTALL_* value.
+ * With --no_cache or --sync the server is asked anyway, but a record
+ * still lets it answer from the digest of its file. Closes the shared
+ * connection if a step opened one.
+ */
+int copy_key_to_server(Options *opts, const char *key_content, StateCache *cache) {
+    unsigned char fingerprint[SHA256_LEN];
+    unsigned char id[SHA256_LEN];
+    const StateRecord *known = NULL;
+    Buffer out = { NULL, 0, 0, NULL, NULL };
+    char when[32];
+    time_t confirmed;
+    int cacheable = key_fingerprint(key_content, fingerprint) == 0;
+    int added;
+    int removed;
+    int kept;
+    int result;
+    
+    if (cacheable) {
+        state_id(opts, fingerprint, id);
+        if (!opts->force) {
+            known = state_lookup(cache, opts, id);
+        }
+    }
+    if (known && !opts->no_cache && !opts->sync) {
+        if (!opts->quiet) {
+            confirmed = (time_t)known->confirmed;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&confirmed));
+            printf("Key already installed (confirmed %s), use --no_cache to check again\n", when);
+        }
+        return INSTALL_CACHED;
+    }
+    
+    if (!opts->quiet) {
+        printf(opts->sync ? "Syncing managed keys in authorized_keys...\n"
+                          : "Adding key to authorized_keys...\n");
+    }
+    result = install_key(opts, key_content, known, &out);
+    mux_close(opts);
+    
+    if (opts->sync && result == INSTALL_ADDED) {
+        sync_diff(key_content, &out, &added, &removed, &kept);
+        /*
+         * A key dropped from the block may be cached as installed. The
+         * block is confirmed below, possibly in this same second.
+         */
+        if (removed > 0) {
+            state_forget_host(cache, opts, time(NULL) - 1);
+        }
+    }
+    if (cacheable && (result == INSTALL_ADDED || result == INSTALL_PRESENT ||
+                      result == SYNC_UNCHANGED || result == INSTALL_UNCHANGED)) {
+        state_confirm(cache, id, &out);
+    }
+    if (opts->sync && result == INSTALL_ADDED && !opts->quiet) {
+        printf("Managed keys synced: +%d -%d\n", added, removed);
+        if (kept > 0) {
+            printf("%d dropped key%s still trusted by lines outside the block\n",
+                   kept, kept == 1 ? "" : "s");
+        }
+    }
+    buffer_free(&out);
+    
+    switch (result) {
+    case INSTALL_ADDED:
+        return 0;
+    case INSTALL_PRESENT:
+        printf("Key already exists on server\n");
+        return 0;
+    case SYNC_UNCHANGED:
+        if (!opts->quiet) {
+            printf("Managed keys already in sync, nothing changed\n");
+        }
+        return 0;
+    case INSTALL_UNCHANGED:
+        if (!opts->quiet) {
+            printf("authorized_keys unchanged since the last confirmed %s\n",
+                   opts->sync ? "sync" : "install");
+        }
+        return INSTALL_UNCHANGED;
+    case INSTALL_NO_AWK:
+        fprintf(stderr, "--sync needs awk on the server\n");
+        break;
+    case INSTALL_NO_SSH_DIR:
+        fprintf(stderr, "Failed to create ~/.ssh directory on server\n");
+        break;
+    case INSTALL_WRITE_FAILED:
+        fprintf(stderr, "Failed to write ~/.ssh/authorized_keys on server\n");
+        break;
+    }
+    return result;
+}
+
+/*
+ * The numbers on the "<word> N [M]" line a remote script printed to
+ * `out`, e.g. "removed 2"; zero for those that are missing.
+ */
+static void script_counts(const Buffer *out, const char *word, int *first, int *second) {
+    const char *p = out->data;
+    size_t len = strlen(word);
+    int counts[2] = { 0, 0 };
+    
+    while (p && *p) {
+        if (strncmp(p, word, len) == 0 && p[len] == ' ') {
+            sscanf(p + len, "%d %d", &counts[0], &counts[1]);
+            break;
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
+        }
+    }
+    *first = counts[0];
+    if (second) {
+        *second = counts[1];
+    }
+}
+
+/*
+ * Remove the keys of key_content, and those whose fingerprint is in
+ * `fingerprints`, from authorized_keys on the server in one rewrite. Keys
+ * known only by fingerprint are looked for here, in the file fetched
+ * first; the fetch and the removal then share one connection (see
+ * mux_open()). Returns INSTALL_ADDED if any line went, REMOVE_NOT_FOUND,
+ * or a failing INSTALL_* value.
+ */
+int remove_keys(Options *opts, const char *key_content, const FpSet *fingerprints, Buffer *out) {
+    KeyStream stream;
+    KeyMatch match;
+    Buffer remote = { NULL, 0, 0, keystream_feed, NULL };
+    Buffer lines = { NULL, 0, 0, NULL, NULL };
+    double started;
+    int result = 0;
+    
+    if (fingerprints->count > 0) {
+        started = timing_start();
+        result = mux_open(opts);
+        timing_end(PHASE_CONNECT, started);
+    }
+    if (result == 0 && fingerprints->count > 0) {
+        started = timing_start();
+        match.wanted = fingerprints;
+        match.lines = &lines;
+        keystream_init(&stream, keys_match, &match);
+        remote.sink_ctx = &stream;
+        result = run_remote(opts, FETCH_SCRIPT, NULL, 0, &remote);
+        keystream_end(&stream);
+        timing_end(PHASE_FETCH, started);
+    }
+    if (result == 0) {
+        buffer_append(&lines, key_content, strlen(key_content));
+    }
+    if (result == 0 && lines.len == 0) {
+        result = REMOVE_NOT_FOUND;
+    } else if (result == 0) {
+        started = timing_start();
+        result = run_remote(opts, REMOVE_SCRIPT, lines.data, lines.len, out);
+        timing_end(PHASE_SCRIPT, started);
+    }
+    buffer_free(&lines);
+    return result;
+}
+
+/*
+ * --remove on a single host. A removal makes the state cache forget what
+ * it knew about the host. Returns 0 if the keys are gone (or were never
+ * there), otherwise the failing INSTALL_* value.
+ */
+int remove_from_server(Options *opts, const char *key_content, const FpSet *fingerprints,
+                       StateCache *cache) {
+    Buffer out = { NULL, 0, 0, NULL, NULL };
+    int removed = 0;
+    int result;
+    
+    if (!opts->quiet) {
+        printf("Removing keys from authorized_keys...\n");
+    }
+    result = remove_keys(opts, key_content, fingerprints, &out);
+    mux_close(opts);
+    
+    if (result == INSTALL_ADDED) {
+        state_forget_host(cache, opts, time(NULL));
+        script_counts(&out, "removed", &removed, NULL);
+    }
+    buffer_free(&out);
+    
+    switch (result) {
+    case INSTALL_ADDED:
+        if (!opts->quiet) {
+            printf("Removed %d line%s\n", removed, removed == 1 ? "" : "s");
+        }
+        return 0;
+    case REMOVE_NOT_FOUND:
+        printf("Key not present on server\n");
+        return 0;
+    case INSTALL_NO_AWK:
+        fprintf(stderr, "--remove needs awk on the server\n");
+        break;
+    case INSTALL_WRITE_FAILED:
+        fprintf(stderr, "Failed to write ~/.ssh/authorized_keys on server\n");
+        break;
+    }
+    return result;
+}
+
+/*
+ * --rotate on a single host. The whole rotation is one remote command, so
+ * one login. Returns 0 if the host ends up with the new keys and without
+ * the old, otherwise the failing INSTALL_* value.
+ */
+int rotate_on_server(Options *opts, const char *rotate_input, StateCache *cache) {
+    Buffer out = { NULL, 0, 0, NULL, NULL };
+    double started;
+    int added = 0;
+    int removed = 0;
+    int result;
+    
+    if (!opts->quiet) {
+        printf("Rotating keys in authorized_keys...\n");
+    }
+    started = timing_start();
+    result = run_remote(opts, ROTATE_SCRIPT, rotate_input, strlen(rotate_input), &out);
+    timing_end(PHASE_SCRIPT, started);
+    if (result == INSTALL_ADDED) {
+        state_forget_host(cache, opts, time(NULL));
+        script_counts(&out, "rotated", &added, &removed);
+    }
+    buffer_free(&out);
+    
+    switch (result) {
+    case INSTALL_ADDED:
+        if (!opts->quiet) {
+            printf("Keys rotated: +%d -%d\n", added, removed);
+        }
+        return 0;
+    case INSTALL_PRESENT:
+        printf("Already rotated: new keys present, old keys gone\n");
+        return 0;
+    case INSTALL_NO_AWK:
+        fprintf(stderr, "--rotate needs awk on the server\n");
+        break;
+    case INSTALL_NO_SSH_DIR:
+        fprintf(stderr, "Failed to create ~/.ssh directory on server\n");
+        break;
+    case INSTALL_WRITE_FAILED:
+        fprintf(stderr, "Failed to write ~/.ssh/authorized_keys on server\n");
+        break;
+    }
+    return result;
+}
+
+/* The number of distinct keys in key_content */
+static int keys_count(const char *key_content) {
+    KeyParser parser;
+    KeyLine key;
+    int count = 0;
+    
+    keys_init(&parser, key_content, strlen(key_content));
+    while (keys_next(&parser, &key)) {
+        if (key.kind == KEYLINE_KEY) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Describe a --check result: `missing` is the number of keys of
+ * key_content the host lacks, 0 if not known (then it lacks them all).
+ */
+static void check_text(const char *key_content, int status, int missing, char *text, size_t size) {
+    int keys = keys_count(key_content);
+    
+    if (missing <= 0 || missing > keys) {
+        missing = keys;
+    }
+    if (status == INSTALL_PRESENT) {
+        snprintf(text, size, keys == 1 ? "key present" : "all %d keys present", keys);
+    } else if (keys == 1) {
+        snprintf(text, size, "key missing");
+    } else {
+        snprintf(text, size, "%d of %d keys missing", missing, keys);
+    }
+}
+
+/*
+ * Look for the keys of key_content in authorized_keys on the server
+ * without changing anything. *missing is set to the number of keys not
+ * found, if known. Without awk there the file is fetched and searched
+ * here instead. Returns INSTALL_PRESENT, CHECK_MISSING or the failing
+ * ssh status.
+ */
+int check_keys(Options *opts, const char *key_content, int *missing) {
+    KeyStream stream;
+    FpSet have;
+    Buffer out = { NULL, 0, 0, NULL, NULL };
+    Buffer remote = { NULL, 0, 0, keystream_feed, NULL };
+    Buffer payload = { NULL, 0, 0, NULL, NULL };
+    double started = timing_start();
+    int result;
+    
+    *missing = 0;
+    result = run_remote(opts, CHECK_SCRIPT, key_content, strlen(key_content), &out);
+    timing_end(PHASE_SCRIPT, started);
+    if (result == CHECK_MISSING) {
+        script_counts(&out, "missing", missing, NULL);
+    }
+    buffer_free(&out);
+    if (result != INSTALL_NO_AWK) {
+        return result;
+    }
+    
+    memset(&have, 0, sizeof(have));
+    keystream_init(&stream, fpset_collect, &have);
+    remote.sink_ctx = &stream;
+    started = timing_start();
+    result = run_remote(opts, FETCH_SCRIPT, NULL, 0, &remote);
+    timing_end(PHASE_FETCH, started);
+    keystream_end(&stream);
+    if (result == 0) {
+        *missing = keys_missing(key_content, &have, &payload);
+        result = *missing == 0 ? INSTALL_PRESENT : CHECK_MISSING;
+    }
+    buffer_free(&payload);
+    fpset_free(&have);
+    return result;
+}
+
+/*
+ * --check on a single host: is the key in authorized_keys? Read only, in
+ * batch mode, over one login. Returns 0 if every key is there, 1 if not,
+ * otherwise the failing ssh status.
+ */
+int check_on_server(Options *opts, const char *key_content) {
+    char text[64];
+    int missing;
+    int result;
+    
+    result = check_keys(opts, key_content, &missing);
+    if (result == INSTALL_PRESENT || result == CHECK_MISSING) {
+        check_text(key_content, result, missing, text, sizeof(text));
+        if (!opts->quiet || result == CHECK_MISSING) {
+            printf("%s on %s@%s\n", text, opts->user, opts->host);
+        }
+        return result == INSTALL_PRESENT ? 0 : 1;
+    }
+    return result;
+}
+
+/* Append a copy of target to the list */
+int target_list_add(TargetList *targets, const char *target) {
+    if (targets->count == targets->capacity) {
+        size_t capacity = targets->capacity ? targets->capacity * 2 : 16;
+        char **items = realloc(targets->items, capacity * sizeof(char *));
+        if (!items) {
+            return -1;
+        }
+        targets->items = items;
+        targets->capacity = capacity;
+    }
+    targets->items[targets->count] = strdup(target);
+    if (!targets->items[targets->count]) {
+        return -1;
+    }
+    targets->count++;
+    return 0;
+}
+
+void target_list_free(TargetList *targets) {
+    size_t i;
+    
+    for (i = 0; i < targets->count; i++) {
+        free(targets->items[i]);
+    }
+    free(targets->items);
+    memset(targets, 0, sizeof(*targets));
+}
+
+/*
+ * Fill opts with the next target, starting from the base options.
+ * Inventory lines are "[user@]host[:port] [identity_file [ssh_config]]";
+ * "-" keeps the default for a column, blank lines and # comments are
+ * skipped. Returns 1 for a target, 0 at the end, -1 for a bad line (the
+ * caller reports it and asks again).
+ */
+int target_source_next(TargetSource *source, const Options *base, Options *opts) {
+    char line[MAX_PATH_LEN * 2 + 512];
+    char *fields[3];
+    char *p;
+    int count;
+    
+    *opts = *base;
+    if (source->args && source->arg_next < source->args->count) {
+        const char *target = source->args->items[source->arg_next++];
+        if (parse_target(target, opts) != 0) {
+            fprintf(stderr, "Invalid target: %s\n", target);
+            return -1;
+        }
+        return 1;
+    }
+    
+    while (source->inventory && fgets(line, sizeof(line), source->inventory)) {
+        source->line_no++;
+        if (!strchr(line, '\n') && !feof(source->inventory)) {
+            /* Overlong line: drop the rest of it */
+            int c;
+            while ((c = fgetc(source->inventory)) != EOF && c != '\n') {
+            }
+            fprintf(stderr, "%s:%lu: line too long\n", source->inventory_path, source->line_no);
+            return -1;
+        }
+        
+        count = 0;
+        p = line;
+        while (count < 3) {
+            p += strspn(p, " \t\r\n");
+            if (*p == '\0') {
+                break;
+            }
+            fields[count++] = p;
+            p += strcspn(p, " \t\r\n");
+            if (*p != '\0') {
+                *p++ = '\0';
+            }
+        }
+        if (count == 0 || fields[0][0] == '#') {
+            continue;
+        }
+        if (parse_target(fields[0], opts) != 0) {
+            fprintf(stderr, "%s:%lu: bad target: %s\n", source->inventory_path,
+                    source->line_no, fields[0]);
+            return -1;
+        }
+        if (count > 1 && strcmp(fields[1], "-") != 0) {
+            strncpy(opts->identity_file, fields[1], sizeof(opts->identity_file) - 1);
+            opts->identity_file[sizeof(opts->identity_file) - 1] = '\0';
+            opts->key_file[0] = '\0';
+        }
+        if (count > 2 && strcmp(fields[2], "-") != 0) {
+            strncpy(opts->ssh_config, fields[2], sizeof(opts->ssh_config) - 1);
+            opts->ssh_config[sizeof(opts->ssh_config) - 1] = '\0';
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Fleet audit (--audit). Every host's authorized_keys is streamed back and
+ * parsed as it arrives; each key line becomes one AuditEntry. Nothing is
+ * kept per host but its name and counts, so memory grows with the number
+ * of key lines, not with the size of the files.
+ */
+#define AUDIT_FILE "ssh-copy-id.audit"
+
+/* Make room for one more item of `size` bytes in a growable array */
+static int array_reserve(void **items, size_t *capacity, size_t count, size_t size) {
+    size_t wanted = *capacity ? *capacity * 2 : 256;
+    void *grown;
+    
+    if (count < *capacity) {
+        return 0;
+    }
+    grown = realloc(*items, wanted * size);
+    if (!grown) {
+        return -1;
+    }
+    *items = grown;
+    *capacity = wanted;
+    return 0;
+}
+
+/* Copy a string into the pool; its offset, or 0 (the empty string) */
+static size_t audit_string(Audit *audit, const char *str, size_t len) {
+    size_t offset;
+    
+    if (len == 0 || (audit->strings.len == 0 && buffer_append(&audit->strings, "", 1) != 0)) {
+        return 0;
+    }
+    offset = audit->strings.len;
+    if (buffer_append(&audit->strings, str, len) != 0 ||
+        buffer_append(&audit->strings, "", 1) != 0) {
+        audit->strings.len = offset;
+        return 0;
+    }
+    return offset;
+}
+
+static const char *audit_text(const Audit *audit, size_t offset) {
+    return offset ? audit->strings.data + offset : "";
+}
+
+/* Add the host in `opts`; its index goes to `index` */
+int audit_host(Audit *audit, const Options *opts, size_t *index) {
+    AuditHost *host;
+    
+    if (array_reserve((void **)&audit->hosts, &audit->host_capacity, audit->host_count,
+                      sizeof(AuditHost)) != 0) {
+        return -1;
+    }
+    host = &audit->hosts[audit->host_count];
+    memset(host, 0, sizeof(*host));
+    host->user = audit_string(audit, opts->user, strlen(opts->user));
+    host->host = audit_string(audit, opts->host, strlen(opts->host));
+    host->port = opts->port;
+    host->status = -1;
+    *index = audit->host_count++;
+    return 0;
+}
+
+/* Record a line of the authorized_keys of host number `host` */
+int audit_add(Audit *audit, size_t host, const KeyLine *key) {
+    unsigned char fingerprint[SHA256_LEN];
+    AuditEntry *entry;
+    size_t index;
+    int rc;
+    
+    if (key->kind != KEYLINE_KEY || blob_fingerprint(key->blob, fingerprint) != 0) {
+        return 0;
+    }
+    if (array_reserve((void **)&audit->key_info, &audit->key_capacity, audit->keys.count,
+                      sizeof(AuditKey)) != 0 ||
+        array_reserve((void **)&audit->entries, &audit->entry_capacity, audit->entry_count,
+                      sizeof(AuditEntry)) != 0 ||
+        (rc = fpset_add(&audit->keys, fingerprint, &index)) < 0) {
+        return -1;
+    }
+    if (rc > 0) {
+        audit->key_info[index].type = audit_string(audit, key->type.ptr, key->type.len);
+        audit->key_info[index].comment = audit_string(audit, key->comment.ptr, key->comment.len);
+    }
+    entry = &audit->entries[audit->entry_count++];
+    entry->key = index;
+    entry->host = host;
+    entry->line_no = key->line_no;
+    entry->options = audit_string(audit, key->options.ptr, key->options.len);
+    audit->hosts[host].keys++;
+    return 0;
+}
+
+/* A fingerprint and the index it was added at, for sorting */
+typedef struct {
+    unsigned char fingerprint[SHA256_LEN];
+    size_t index;
+} AuditRank;
+
+static int audit_rank_cmp(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_LEN);
+}
+
+static int audit_entry_cmp(const void *a, const void *b) {
+    const AuditEntry *x = a;
+    const AuditEntry *y = b;
+    
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    if (x->host != y->host) {
+        return x->host < y->host ? -1 : 1;
+    }
+    return x->line_no < y->line_no ? -1 : x->line_no > y->line_no;
+}
+
+/* A host and the index it was added at, for sorting by name */
+typedef struct {
+    const char *host;
+    const char *user;
+    int port;
+    size_t index;
+} AuditHostRank;
+
+static int audit_host_cmp(const void *a, const void *b) {
+    const AuditHostRank *x = a;
+    const AuditHostRank *y = b;
+    int c = strcmp(x->host, y->host);
+    
+    if (c == 0) {
+        c = strcmp(x->user, y->user);
+    }
+    if (c == 0 && x->port != y->port) {
+        c = x->port < y->port ? -1 : 1;
+    }
+    if (c == 0 && x->index != y->index) {
+        c = x->index < y->index ? -1 : 1;
+    }
+    return c;
+}
+
+/* Put the hosts in order of name, user and port */
+static void audit_sort_hosts(Audit *audit) {
+    AuditHostRank *ranks = malloc(audit->host_count * sizeof(AuditHostRank));
+    AuditHost *sorted = malloc(audit->host_count * sizeof(AuditHost));
+    size_t *rank_of = malloc(audit->host_count * sizeof(size_t));
+    size_t i;
+    
+    if (ranks && sorted && rank_of) {
+        for (i = 0; i < audit->host_count; i++) {
+            ranks[i].host = audit_text(audit, audit->hosts[i].host);
+            ranks[i].user = audit_text(audit, audit->hosts[i].user);
+            ranks[i].port = audit->hosts[i].port;
+            ranks[i].index = i;
+        }
+        qsort(ranks, audit->host_count, sizeof(AuditHostRank), audit_host_cmp);
+        for (i = 0; i < audit->host_count; i++) {
+            sorted[i] = audit->hosts[ranks[i].index];
+            rank_of[ranks[i].index] = i;
+        }
+        for (i = 0; i < audit->entry_count; i++) {
+            audit->entries[i].host = rank_of[audit->entries[i].host];
+        }
+        free(audit->hosts);
+        audit->hosts = sorted;
+        audit->host_capacity = audit->host_count;
+        sorted = NULL;
+    }
+    free(ranks);
+    free(sorted);
+    free(rank_of);
+}
+
+/* Order hosts and entries as described at Audit */
+void audit_sort(Audit *audit) {
+    AuditRank *ranks;
+    size_t *rank_of;
+    size_t i;
+    
+    if (audit->host_count > 0) {
+        audit_sort_hosts(audit);
+    }
+    if (audit->keys.count == 0) {
+        return;
+    }
+    ranks = malloc(audit->keys.count * sizeof(AuditRank));
+    rank_of = malloc(audit->keys.count * sizeof(size_t));
+    audit->key_order = malloc(audit->keys.count * sizeof(size_t));
+    if (!ranks || !rank_of || !audit->key_order) {
+        free(ranks);
+        free(rank_of);
+        free(audit->key_order);
+        audit->key_order = NULL;
+        return;
+    }
+    for (i = 0; i < audit->keys.count; i++) {
+        memcpy(ranks[i].fingerprint, audit->keys.items[i], SHA256_LEN);
+        ranks[i].index = i;
+    }
+    qsort(ranks, audit->keys.count, sizeof(AuditRank), audit_rank_cmp);
+    for (i = 0; i < audit->keys.count; i++) {
+        audit->key_order[i] = ranks[i].index;
+        rank_of[ranks[i].index] = i;
+    }
+    for (i = 0; i < audit->entry_count; i++) {
+        audit->entries[i].key = rank_of[audit->entries[i].key];
+    }
+    qsort(audit->entries, audit->entry_count, sizeof(AuditEntry), audit_entry_cmp);
+    free(ranks);
+    free(rank_of);
+}
+
+/* Write `str` as a JSON string */
+static void json_string(FILE *fp, const char *str) {
+    const unsigned char *p = (const unsigned char *)str;
+    
+    fputc('"', fp);
+    for (; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void json_host(FILE *fp, const Audit *audit, const AuditHost *host) {
+    fputs("\"user\": ", fp);
+    json_string(fp, audit_text(audit, host->user));
+    fputs(", \"host\": ", fp);
+    json_string(fp, audit_text(audit, host->host));
+    fprintf(fp, ", \"port\": %d", host->port);
+}
+
+/*
+ * The sorted audit as JSON: the hosts with their results, then every key
+ * with the hosts, lines and options it is trusted with.
+ */
+void audit_write_json(const Audit *audit, FILE *fp) {
+    char text[FINGERPRINT_TEXT_LEN];
+    const AuditHost *host;
+    const AuditKey *info;
+    const AuditEntry *entry;
+    size_t key;
+    size_t i;
+    
+    fputs("{\n  \"hosts\": [", fp);
+    for (i = 0; i < audit->host_count; i++) {
+        host = &audit->hosts[i];
+        fputs(i ? ",\n    {" : "\n    {", fp);
+        json_host(fp, audit, host);
+        fprintf(fp, ", \"ok\": %s, \"keys\": %lu}", host->status == 0 ? "true" : "false",
+                host->keys);
+    }
+    fputs(audit->host_count ? "\n  ],\n  \"keys\": [" : "],\n  \"keys\": [", fp);
+    for (i = 0; i < audit->entry_count && audit->key_order; i++) {
+        entry = &audit->entries[i];
+        key = audit->key_order[entry->key];
+        if (i == 0 || entry->key != audit->entries[i - 1].key) {
+            info = &audit->key_info[key];
+            fingerprint_text(audit->keys.items[key], text);
+            fputs(i ? "\n    ]},\n    {\"fingerprint\": " : "\n    {\"fingerprint\": ", fp);
+            json_string(fp, text);
+            fputs(", \"type\": ", fp);
+            json_string(fp, audit_text(audit, info->type));
+            fputs(", \"comment\": ", fp);
+            json_string(fp, audit_text(audit, info->comment));
+            fputs(", \"hosts\": [\n      {", fp);
+        } else {
+            fputs(",\n      {", fp);
+        }
+        json_host(fp, audit, &audit->hosts[entry->host]);
+        fprintf(fp, ", \"line\": %lu, \"options\": ", entry->line_no);
+        json_string(fp, audit_text(audit, entry->options));
+        fputc('}', fp);
+    }
+    fputs(audit->entry_count && audit->key_order ? "\n    ]}\n  ]\n}\n" : "]\n}\n", fp);
+}
+
+/*
+ * The saved audit is a snapshot meant to be mapped and searched in place,
+ * without parsing or per-record allocation:
+ *   header   magic[8] key_count host_count entry_count strings_len 0[8]
+ *   keys     fingerprint[32] type comment first count  (by fingerprint)
+ *   hosts    user host port status first count         (by name, user, port)
+ *   entries  key host line options                     (by key, host, line)
+ *   by_host  entry                                     (by host, line)
+ *   strings  NUL-terminated, "" at offset 0
+ * Numbers are 32-bit little-endian. A key's lines are
+ * entries[first, first + count), a host's are by_host[first, first + count).
+ */
+#define SNAPSHOT_MAGIC  "sciaud01"
+#define SNAPSHOT_HEADER 32
+#define SNAPSHOT_KEY    48
+#define SNAPSHOT_HOST   24
+#define SNAPSHOT_ENTRY  16
+#define SNAPSHOT_REF    4
+
+/* An entry's place in by_host */
+typedef struct {
+    size_t host;
+    unsigned long line_no;
+    size_t entry;
+} AuditRef;
+
+static int audit_ref_cmp(const void *a, const void *b) {
+    const AuditRef *x = a;
+    const AuditRef *y = b;
+    
+    if (x->host != y->host) {
+        return x->host < y->host ? -1 : 1;
+    }
+    return x->line_no < y->line_no ? -1 : x->line_no > y->line_no;
+}
+
+static void snapshot_write(FILE *fp, const void *data, size_t len, int *ok) {
+    if (*ok && len > 0 && fwrite(data, 1, len, fp) != len) {
+        *ok = 0;
+    }
+}
+
+/*
+ * Save the sorted audit to `path` as a snapshot. It is written to a
+ * temporary file first and renamed into place.
+ */
+int audit_save(const Audit *audit, const char *path) {
+    unsigned char raw[SNAPSHOT_KEY];
+    char tmp[MAX_PATH_LEN + 8];
+    const AuditHost *host;
+    const AuditEntry *entry;
+    AuditRef *refs;
+    size_t first = 0;
+    size_t next = 0;
+    size_t i;
+    FILE *fp;
+    int ok = 1;
+    
+    if ((audit->entry_count > 0 && !audit->key_order) || audit->entry_count > 0xFFFFFFFFu ||
+        audit->strings.len > 0xFFFFFFFFu ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    refs = malloc((audit->entry_count ? audit->entry_count : 1) * sizeof(AuditRef));
+    if (!refs) {
+        return -1;
+    }
+    for (i = 0; i < audit->entry_count; i++) {
+        refs[i].host = audit->entries[i].host;
+        refs[i].line_no = audit->entries[i].line_no;
+        refs[i].entry = i;
+    }
+    qsort(refs, audit->entry_count, sizeof(AuditRef), audit_ref_cmp);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(refs);
+        return -1;
+    }
+    
+    memset(raw, 0, SNAPSHOT_HEADER);
+    memcpy(raw, SNAPSHOT_MAGIC, 8);
+    put_le(raw + 8, audit->keys.count, 4);
+    put_le(raw + 12, audit->host_count, 4);
+    put_le(raw + 16, audit->entry_count, 4);
+    put_le(raw + 20, audit->strings.len ? audit->strings.len : 1, 4);
+    snapshot_write(fp, raw, SNAPSHOT_HEADER, &ok);
+    for (i = 0; i < audit->keys.count; i++) {
+        /* Every key has at least one entry, and they are in key order */
+        for (first = next; next < audit->entry_count && audit->entries[next].key == i; next++) {
+        }
+        memcpy(raw, audit->keys.items[audit->key_order[i]], SHA256_LEN);
+        put_le(raw + 32, audit->key_info[audit->key_order[i]].type, 4);
+        put_le(raw + 36, audit->key_info[audit->key_order[i]].comment, 4);
+        put_le(raw + 40, first, 4);
+        put_le(raw + 44, next - first, 4);
+        snapshot_write(fp, raw, SNAPSHOT_KEY, &ok);
+    }
+    for (i = 0, first = 0; i < audit->host_count; i++) {
+        host = &audit->hosts[i];
+        put_le(raw, host->user, 4);
+        put_le(raw + 4, host->host, 4);
+        put_le(raw + 8, (unsigned long long)host->port, 4);
+        put_le(raw + 12, (uint32_t)host->status, 4);
+        put_le(raw + 16, first, 4);
+        put_le(raw + 20, host->keys, 4);
+        first += host->keys;
+        snapshot_write(fp, raw, SNAPSHOT_HOST, &ok);
+    }
+    for (i = 0; i < audit->entry_count; i++) {
+        entry = &audit->entries[i];
+        put_le(raw, entry->key, 4);
+        put_le(raw + 4, entry->host, 4);
+        put_le(raw + 8, entry->line_no, 4);
+        put_le(raw + 12, entry->options, 4);
+        snapshot_write(fp, raw, SNAPSHOT_ENTRY, &ok);
+    }
+    for (i = 0; i < audit->entry_count; i++) {
+        put_le(raw, refs[i].entry, 4);
+        snapshot_write(fp, raw, SNAPSHOT_REF, &ok);
+    }
+    snapshot_write(fp, audit->strings.len ? audit->strings.data : "",
+                   audit->strings.len ? audit->strings.len : 1, &ok);
+    free(refs);
+    
+    if (fclose(fp) != 0 || !ok) {
+        remove(tmp);
+        return -1;
+    }
+#ifdef _WIN32
+    /* rename() does not replace an existing file there */
+    remove(path);
+#endif
+    if (rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void audit_free(Audit *audit) {
+    fpset_free(&audit->keys);
+    free(audit->key_info);
+    free(audit->key_order);
+    free(audit->hosts);
+    free(audit->entries);
+    buffer_free(&audit->strings);
+    memset(audit, 0, sizeof(*audit));
+}
+
+static uint32_t snapshot_u32(const unsigned char *p) {
+    return (uint32_t)get_le(p, 4);
+}
+
+void snapshot_close(Snapshot *snap) {
+    if (snap->data) {
+#ifdef _WIN32
+        UnmapViewOfFile(snap->data);
+        CloseHandle(snap->mapping);
+#else
+        munmap((void *)snap->data, snap->size);
+#endif
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+/*
+ * Map the snapshot at `path`. Only the header is checked against the file
+ * size here; indices and offsets are checked as they are used. Returns -1
+ * if it cannot be read, -2 if it is not a snapshot.
+ */
+int snapshot_open(Snapshot *snap, const char *path) {
+    unsigned long long expected;
+#ifdef _WIN32
+    HANDLE file;
+    LARGE_INTEGER size;
+#else
+    struct stat st;
+    void *map;
+    int fd;
+#endif
+    
+    memset(snap, 0, sizeof(*snap));
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < SNAPSHOT_HEADER) {
+        CloseHandle(file);
+        return -2;
+    }
+    snap->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!snap->mapping) {
+        return -1;
+    }
+    snap->data = MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!snap->data) {
+        CloseHandle(snap->mapping);
+        return -1;
+    }
+    snap->size = (size_t)size.QuadPart;
+#else
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEADER) {
+        close(fd);
+        return -2;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    snap->data = map;
+    snap->size = (size_t)st.st_size;
+#endif
+    
+    snap->key_count = snapshot_u32(snap->data + 8);
+    snap->host_count = snapshot_u32(snap->data + 12);
+    snap->entry_count = snapshot_u32(snap->data + 16);
+    snap->strings_len = snapshot_u32(snap->data + 20);
+    expected = SNAPSHOT_HEADER + (unsigned long long)snap->key_count * SNAPSHOT_KEY +
+               (unsigned long long)snap->host_count * SNAPSHOT_HOST +
+               (unsigned long long)snap->entry_count * (SNAPSHOT_ENTRY + SNAPSHOT_REF) +
+               snap->strings_len;
+    if (memcmp(snap->data, SNAPSHOT_MAGIC, 8) != 0 || expected != snap->size ||
+        snap->strings_len == 0 || snap->data[snap->size - 1] != '\0') {
+        snapshot_close(snap);
+        return -2;
+    }
+    snap->keys = snap->data + SNAPSHOT_HEADER;
+    snap->hosts = snap->keys + (size_t)snap->key_count * SNAPSHOT_KEY;
+    snap->entries = snap->hosts + (size_t)snap->host_count * SNAPSHOT_HOST;
+    snap->by_host = snap->entries + (size_t)snap->entry_count * SNAPSHOT_ENTRY;
+    snap->strings = (const char *)snap->by_host + (size_t)snap->entry_count * SNAPSHOT_REF;
+    return 0;
+}
+
+static const char *snapshot_text(const Snapshot *snap, uint32_t offset) {
+    return offset < snap->strings_len ? snap->strings + offset : "";
+}
+
+/* The key with `fingerprint` (keys are sorted), or -1 */
+static long snapshot_find_key(const Snapshot *snap, const unsigned char fingerprint[SHA256_LEN]) {
+    size_t lo = 0;
+    size_t hi = snap->key_count;
+    size_t mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (memcmp(snap->keys + mid * SNAPSHOT_KEY, fingerprint, SHA256_LEN) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < snap->key_count &&
+           memcmp(snap->keys + lo * SNAPSHOT_KEY, fingerprint, SHA256_LEN) == 0 ? (long)lo : -1;
+}
+
+/* The first host named `name` or after it (hosts are sorted by name) */
+static size_t snapshot_find_host(const Snapshot *snap, const char *name) {
+    size_t lo = 0;
+    size_t hi = snap->host_count;
+    size_t mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(snapshot_text(snap, snapshot_u32(snap->hosts + mid * SNAPSHOT_HOST + 4)),
+                   name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* "user@host:port", with IPv6 addresses in brackets */
+static void snapshot_host_name(const Snapshot *snap, uint32_t host, char *name, size_t size) {
+    const unsigned char *rec = snap->hosts + (size_t)host * SNAPSHOT_HOST;
+    const char *addr = snapshot_text(snap, snapshot_u32(rec + 4));
+    
+    snprintf(name, size, strchr(addr, ':') ? "%s@[%s]:%lu" : "%s@%s:%lu",
+             snapshot_text(snap, snapshot_u32(rec)), addr, (unsigned long)snapshot_u32(rec + 8));
+}
+
+/* The saved audit: --audit_file, else ~/.ssh/ssh-copy-id.audit if ~/.ssh exists */
+static int audit_path(const Options *opts, char *path, size_t size) {
+    const char *home = get_home_dir();
+    
+    if (opts->audit_file[0] != '\0') {
+        snprintf(path, size, "%s", opts->audit_file);
+        return 0;
+    }
+    if (!home || snprintf(path, size, "%s" PATH_SEP ".ssh", home) >= (int)size ||
+        !is_directory(path) ||
+        snprintf(path, size, "%s" PATH_SEP ".ssh" PATH_SEP AUDIT_FILE, home) >= (int)size) {
+        path[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the saved audit for a question, reporting why if it cannot be */
+static int audit_open(const Options *opts, Snapshot *snap) {
+    char path[MAX_PATH_LEN];
+    int rc;
+    
+    if (audit_path(opts, path, sizeof(path)) != 0) {
+        fprintf(stderr, "No audit file, run --audit first or give --audit_file\n");
+        return -1;
+    }
+    rc = snapshot_open(snap, path);
+    if (rc == -1) {
+        fprintf(stderr, "Cannot read audit file %s, run --audit first\n", path);
+    } else if (rc != 0) {
+        fprintf(stderr, "Not an audit snapshot: %s\n", path);
+    }
+    return rc;
+}
+
+/*
+ * --where_is: every host and line that trusts the key with the given
+ * fingerprint, from the saved audit. Returns 0 if there is any.
+ */
+int where_is(const Options *opts) {
+    unsigned char fingerprint[SHA256_LEN];
+    char name[600];
+    const unsigned char *key;
+    const unsigned char *entry;
+    const char *options;
+    Snapshot snap;
+    uint32_t first;
+    uint32_t count;
+    uint32_t i;
+    long index;
+    
+    if (parse_fingerprint(opts->where_is, fingerprint) != 0) {
+        fprintf(stderr, "Not a SHA256 fingerprint: %s\n", opts->where_is);
+        return 1;
+    }
+    if (audit_open(opts, &snap) != 0) {
+        return 1;
+    }
+    index = snapshot_find_key(&snap, fingerprint);
+    if (index < 0) {
+        if (!opts->quiet) {
+            printf("%s: not found on any audited host\n", opts->where_is);
+        }
+        snapshot_close(&snap);
+        return 1;
+    }
+    key = snap.keys + (size_t)index * SNAPSHOT_KEY;
+    first = snapshot_u32(key + 40);
+    count = snapshot_u32(key + 44);
+    if (!opts->quiet) {
+        printf("%s %s %s\n", opts->where_is, snapshot_text(&snap, snapshot_u32(key + 32)),
+               snapshot_text(&snap, snapshot_u32(key + 36)));
+    }
+    for (i = 0; i < count && first + i < snap.entry_count; i++) {
+        entry = snap.entries + (size_t)(first + i) * SNAPSHOT_ENTRY;
+        if (snapshot_u32(entry + 4) >= snap.host_count) {
+            continue;
+        }
+        snapshot_host_name(&snap, snapshot_u32(entry + 4), name, sizeof(name));
+        options = snapshot_text(&snap, snapshot_u32(entry + 12));
+        printf("%s %lu%s%s\n", name, (unsigned long)snapshot_u32(entry + 8),
+               *options ? " " : "", options);
+    }
+    snapshot_close(&snap);
+    return 0;
+}
+
+/*
+ * --keys_on: the keys each audited account on a host trusts, from the
+ * saved audit. The target is [user@]host[:port]; without user or port
+ * every account on the host is listed. Returns 0 if the host was read.
+ */
+int keys_on(const Options *opts) {
+    char text[FINGERPRINT_TEXT_LEN];
+    char name[600];
+    Options want;
+    const unsigned char *host;
+    const unsigned char *entry;
+    const unsigned char *key;
+    const char *options;
+    const char *user = NULL;
+    Snapshot snap;
+    uint32_t first;
+    uint32_t count;
+    uint32_t ref;
+    uint32_t i;
+    size_t h;
+    int found = 0;
+    int result = 1;
+    
+    memset(&want, 0, sizeof(want));
+    if (parse_target(opts->keys_on, &want) != 0) {
+        fprintf(stderr, "Invalid target: %s\n", opts->keys_on);
+        return 1;
+    }
+    if (strchr(opts->keys_on, '@')) {
+        user = want.user;
+    }
+    if (audit_open(opts, &snap) != 0) {
+        return 1;
+    }
+    for (h = snapshot_find_host(&snap, want.host); h < snap.host_count; h++) {
+        host = snap.hosts + h * SNAPSHOT_HOST;
+        if (strcmp(snapshot_text(&snap, snapshot_u32(host + 4)), want.host) != 0) {
+            break;
+        }
+        if ((user && strcmp(snapshot_text(&snap, snapshot_u32(host)), user) != 0) ||
+            (want.port && snapshot_u32(host + 8) != (uint32_t)want.port)) {
+            continue;
+        }
+        found = 1;
+        snapshot_host_name(&snap, (uint32_t)h, name, sizeof(name));
+        if ((int32_t)snapshot_u32(host + 12) != 0) {
+            fprintf(stderr, "%s: could not be read in the audit\n", name);
+            continue;
+        }
+        result = 0;
+        first = snapshot_u32(host + 16);
+        count = snapshot_u32(host + 20);
+        for (i = 0; i < count && first + i < snap.entry_count; i++) {
+            ref = snapshot_u32(snap.by_host + (size_t)(first + i) * SNAPSHOT_REF);
+            if (ref >= snap.entry_count) {
+                continue;
+            }
+            entry = snap.entries + (size_t)ref * SNAPSHOT_ENTRY;
+            if (snapshot_u32(entry) >= snap.key_count) {
+                continue;
+            }
+            key = snap.keys + (size_t)snapshot_u32(entry) * SNAPSHOT_KEY;
+            fingerprint_text(key, text);
+            options = snapshot_text(&snap, snapshot_u32(entry + 12));
+            printf("%s %lu %s %s%s%s %s\n", name, (unsigned long)snapshot_u32(entry + 8), text,
+                   options, *options ? " " : "", snapshot_text(&snap, snapshot_u32(key + 32)),
+                   snapshot_text(&snap, snapshot_u32(key + 36)));
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "%s: not in the audit\n", opts->keys_on);
+    }
+    snapshot_close(&snap);
+    return result;
+}
+
+/* Print captured child output line by line, prefixed with the host */
+static void print_host_output(FILE *fp, const Options *opts, const Buffer *buf) {
+    size_t start = 0;
+    size_t end;
+    size_t len;
+    
+    while (start < buf->len) {
+        for (end = start; end < buf->len && buf->data[end] != '\n'; end++) {
         }
-        strncpy(opts->host, target, sizeof(opts->host) - 1);
-        opts->host[sizeof(opts->host) - 1] = '\0';
+        len = end - start;
+        if (len > 0 && buf->data[start + len - 1] == '\r') {
+            len--;
+        }
+        fprintf(fp, "%s@%s: %.*s\n", opts->user, opts->host, (int)len, buf->data + start);
+        start = end + 1;
     }
-    
-    return 0;
 }
 
-/* Get public key file path */
-int get_public_key_path(Options *opts, char *key_path, size_t key_path_size) {
-    char *home_dir = get_home_dir();
+/*
+ * Count one finished host and print its result line, with `text` instead
+ * of the usual description if it is not NULL
+ */
+static void fleet_report(Fleet *fleet, const Options *opts, int result, const char *text) {
+    /* An audit's report is what goes to stdout */
+    FILE *out = opts->audit ? stderr : stdout;
     
-    if (opts->key_file[0] != '\0') {
-        strncpy(key_path, opts->key_file, key_path_size - 1);
-        key_path[key_path_size - 1] = '\0';
-    } else if (opts->identity_file[0] != '\0') {
-        strncpy(key_path, opts->identity_file, key_path_size - 1);
-        key_path[key_path_size - 1] = '\0';
-        if (!strstr(key_path, ".pub")) {
-            strncat(key_path, ".pub", key_path_size - strlen(key_path) - 1);
-        }
+    fleet->hosts++;
+    if (result == INSTALL_ADDED) {
+        fleet->added++;
+    } else if (result == CHECK_MISSING) {
+        fleet->missing++;
+    } else if (result == INSTALL_PRESENT || result == INSTALL_CACHED || result == SYNC_UNCHANGED ||
+               result == INSTALL_UNCHANGED || result == REMOVE_NOT_FOUND) {
+        fleet->present++;
     } else {
-        snprintf(key_path, key_path_size, "%s\\.ssh\\id_rsa.pub", home_dir ? home_dir : ".");
+        fleet->failed++;
     }
-    
-    if (key_path[0] == '~') {
-        char full_path[MAX_PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir ? home_dir : "", key_path + 1);
-        strncpy(key_path, full_path, key_path_size - 1);
-        key_path[key_path_size - 1] = '\0';
+    if (result == CHECK_MISSING) {
+        fprintf(out, "%s@%s: %s\n", opts->user, opts->host,
+                text ? text : install_status_text(result));
+    } else if (result == INSTALL_ADDED || result == INSTALL_PRESENT || result == INSTALL_CACHED ||
+               result == SYNC_UNCHANGED || result == INSTALL_UNCHANGED ||
+               result == REMOVE_NOT_FOUND) {
+        if (!opts->quiet) {
+            fprintf(out, "%s@%s: %s\n", opts->user, opts->host,
+                    text ? text : install_status_text(result));
+        }
+    } else if (result >= 0) {
+        fprintf(stderr, "%s@%s: %s (exit %d)\n", opts->user, opts->host,
+                install_status_text(result), result);
     }
-    
-    return 0;
+    fflush(out);
 }
 
-/* Read public key from file */
-int read_public_key(const char *key_path, char *key_content, size_t key_size) {
-    FILE *fp = fopen(key_path, "r");
-    if (!fp) {
-        return -1;
+static void fleet_done(Job *job, void *ctx);
+#ifdef USE_LIBSSH2
+static void fleet_native_done(NativeJob *job, void *ctx);
+#endif
+
+static void keyset_release(KeySet *keys);
+
+static void fleet_host_free(FleetHost *host) {
+    fpset_free(&host->have);
+    buffer_free(&host->payload);
+    keyset_release(host->own_keys);
+    free(host->own_script);
+    free(host);
+}
+
+static void keyset_release(KeySet *keys) {
+    if (keys && --keys->refs == 0) {
+        buffer_free(&keys->content);
+        free(keys);
     }
+}
+
+/*
+ * The keys in key_path, for an inventory line that names them; NULL if
+ * they cannot be read. The same file as on the line before is not read
+ * again.
+ */
+static KeySet *fleet_keys(Fleet *fleet, const char *key_path) {
+    KeySet *keys = fleet->inventory_keys;
     
-    size_t bytes_read = fread(key_content, 1, key_size - 1, fp);
-    fclose(fp);
-    
-    if (bytes_read == 0) {
-        return -1;
+    if (keys && strcmp(keys->key_path, key_path) == 0) {
+        keys->refs++;
+        return keys;
     }
+    keyset_release(keys);
+    fleet->inventory_keys = NULL;
     
-    key_content[bytes_read] = '\0';
-    trim_string(key_content);
+    keys = calloc(1, sizeof(KeySet));
+    if (!keys) {
+        return NULL;
+    }
+    snprintf(keys->key_path, sizeof(keys->key_path), "%s", key_path);
+    if (read_public_key(key_path, &keys->content) != 0 ||
+        key_fingerprint(keys->content.data, keys->fingerprint) != 0) {
+        buffer_free(&keys->content);
+        free(keys);
+        return NULL;
+    }
+    key_dedup(keys->content.data);
+    keys->content.len = strlen(keys->content.data);
+    install_script(fleet->base, keys->content.data, NULL, keys->script, sizeof(keys->script));
+    /* One reference for the host, one for the next line */
+    keys->refs = 2;
+    fleet->inventory_keys = keys;
+    return keys;
+}
+
+/* BufferSink for the fetched authorized_keys of a host */
+static int fleet_stream(void *ctx, const char *data, size_t len) {
+    FleetHost *host = ctx;
     
-    return 0;
+    return keystream_feed(&host->stream, data, len);
 }
 
-/* Check if SSH client is installed */
-int check_ssh_installed(void) {
-    char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "where ssh >nul 2>&1");
-    return system(cmd) == 0;
+/* KeyStream callback of an audited host */
+static void fleet_audit_line(const KeyLine *key, void *ctx) {
+    FleetHost *host = ctx;
+    
+    audit_add(host->fleet->audit, host->audit_host, key);
 }
 
-/* Execute SSH command */
-int run_ssh_command(Options *opts, const char *remote_cmd) {
-    char cmd[MAX_CMD_LEN];
-    char port_str[32] = "";
-    char config_str[MAX_CMD_LEN] = "";
-    char opts_str[256] = "";
+/* Start step `phase` of the install on `host` */
+static int fleet_step(FleetHost *host, int phase, const char *script,
+                      const char *input, size_t input_len) {
+    Fleet *fleet = host->fleet;
+    BufferSink sink = phase == FLEET_FETCH ? fleet_stream : NULL;
     
-    if (opts->port > 0 && opts->port != 22) {
-        snprintf(port_str, sizeof(port_str), "-p %d ", opts->port);
+    host->phase = phase;
+    host->step_started = timing_start();
+#ifdef USE_LIBSSH2
+    if (native_start(&fleet->native, &host->opts, script, input, input_len, sink,
+                     fleet_native_done, host) == 0) {
+        return 0;
     }
-    
-    if (opts->ssh_config[0] != '\0') {
-        snprintf(config_str, sizeof(config_str), "-F \"%s\" ", opts->ssh_config);
+#endif
+    build_ssh_argv(&host->opts, NULL, script, &host->args);
+    return loop_spawn(&fleet->loop, host->args.argv, input, input_len, sink, fleet_done, host);
+}
+
+/*
+ * Move a host whose server has no awk on to its next step, as
+ * install_key_fallback() does. Returns 1 if a step was started, otherwise
+ * 0 with the final result in *status.
+ */
+static int fleet_fallback(FleetHost *host, int *status) {
+    if (host->phase == FLEET_INSTALL) {
+        if (*status != INSTALL_NO_AWK || host->opts.sync || host->opts.rotate) {
+            return 0;
+        }
+        if (!host->opts.force || host->opts.check) {
+            keystream_init(&host->stream, fpset_collect, &host->have);
+            return fleet_step(host, FLEET_FETCH, FETCH_SCRIPT, NULL, 0) == 0;
+        }
+    } else if (host->phase == FLEET_FETCH) {
+        keystream_end(&host->stream);
+        if (*status != 0) {
+            return 0;
+        }
+    } else {
+        return 0;
     }
-    
-    if (opts->ssh_options[0] != '\0') {
-        snprintf(opts_str, sizeof(opts_str), "-o %s ", opts->ssh_options);
+    host->missing = keys_missing(host->key_content, &host->have, &host->payload);
+    if (host->missing == 0 || host->opts.check) {
+        *status = host->missing == 0 ? INSTALL_PRESENT : CHECK_MISSING;
+        return 0;
     }
-    
-    snprintf(cmd, sizeof(cmd), "ssh %s%s%s-o StrictHostKeyChecking=accept-new %s@%s \"%s\"",
-             config_str, port_str, opts_str, opts->user, opts->host, remote_cmd);
-    
-    return system(cmd);
+    return fleet_step(host, FLEET_APPEND, APPEND_SCRIPT, host->payload.data,
+                      host->payload.len) == 0;
 }
 
-/* Copy key to server */
-int copy_key_to_server(Options *opts, const char *key_content) {
-    char cmd[MAX_CMD_LEN];
-    char port_str[32] = "";
-    char config_str[MAX_CMD_LEN] = "";
-    char escaped_key[MAX_KEY_SIZE];
-    
-    /* Escape key for shell */
-    const char *src = key_content;
-    char *dst = escaped_key;
-    size_t remaining = sizeof(escaped_key) - 1;
+/*
+ * Once a --remove by fingerprint has fetched the file, remove the lines
+ * that matched along with the given keys, as remove_keys() does. Fleet
+ * steps share no connection, so this is a second login to the host.
+ * Returns 1 if that was started, otherwise 0 with the final result in
+ * *status.
+ */
+static int fleet_remove(FleetHost *host, int *status) {
+    if (host->phase != FLEET_FETCH) {
+        return 0;
+    }
+    keystream_end(&host->stream);
+    if (*status != 0) {
+        return 0;
+    }
+    buffer_append(&host->payload, host->key_content, strlen(host->key_content));
+    if (host->payload.len == 0) {
+        *status = REMOVE_NOT_FOUND;
+        return 0;
+    }
+    if (fleet_step(host, FLEET_INSTALL, host->script, host->payload.data,
+                   host->payload.len) != 0) {
+        fprintf(stderr, "%s@%s: cannot start ssh\n", host->opts.user, host->opts.host);
+        *status = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* The host is done: count its time and let it go */
+static void fleet_host_finish(FleetHost *host) {
+    timing_end(PHASE_HOST, host->started);
+    fleet_host_free(host);
+}
+
+/*
+ * A step of the install on one host has finished with `status`; `out` and
+ * `err` are its stdout and stderr.
+ */
+static void fleet_host_done(FleetHost *host, int status, const Buffer *out, const Buffer *err) {
+    char text[64];
+    int added;
+    int removed;
+    int kept;
+    int ok;
     
-    while (*src && remaining > 1) {
-        if (*src == '\'') {
-            if (remaining >= 5) {
-                memcpy(dst, "'\\''", 4);
-                dst += 4;
-                remaining -= 4;
+    timing_end(host->phase == FLEET_FETCH ? PHASE_FETCH
+               : host->phase == FLEET_APPEND ? PHASE_APPEND : PHASE_SCRIPT, host->step_started);
+    if (host->opts.audit) {
+        keystream_end(&host->stream);
+        host->fleet->audit->hosts[host->audit_host].status = status;
+        if (status != 0) {
+            print_host_output(stderr, &host->opts, err);
+        }
+        snprintf(text, sizeof(text), "%lu keys", host->fleet->audit->hosts[host->audit_host].keys);
+        fleet_report(host->fleet, &host->opts, status, status == 0 ? text : NULL);
+        fleet_host_finish(host);
+        return;
+    }
+    if (host->opts.remove ? fleet_remove(host, &status) : fleet_fallback(host, &status)) {
+        return;
+    }
+    ok = status == INSTALL_ADDED || status == INSTALL_PRESENT || status == SYNC_UNCHANGED ||
+         status == INSTALL_UNCHANGED || status == REMOVE_NOT_FOUND || status == CHECK_MISSING;
+    if (!ok || !host->opts.quiet) {
+        print_host_output(stderr, &host->opts, err);
+    }
+    if (host->opts.check) {
+        if (status == INSTALL_PRESENT || status == CHECK_MISSING) {
+            if (host->missing == 0) {
+                script_counts(out, "missing", &host->missing, NULL);
             }
+            check_text(host->key_content, status, host->missing, text, sizeof(text));
+        }
+        fleet_report(host->fleet, &host->opts, status,
+                     status == INSTALL_PRESENT || status == CHECK_MISSING ? text : NULL);
+        fleet_host_finish(host);
+        return;
+    }
+    if (host->opts.remove) {
+        if (status == INSTALL_ADDED) {
+            state_forget_host(host->fleet->cache, &host->opts, time(NULL));
+            script_counts(out, "removed", &removed, NULL);
+            host->fleet->removed += (unsigned long)removed;
+            snprintf(text, sizeof(text), "removed %d line%s", removed, removed == 1 ? "" : "s");
+            fleet_report(host->fleet, &host->opts, status, text);
         } else {
-            *dst++ = *src;
-            remaining--;
+            fleet_report(host->fleet, &host->opts, status, NULL);
         }
-        src++;
+        fleet_host_finish(host);
+        return;
     }
-    *dst = '\0';
-    
-    if (opts->port > 0 && opts->port != 22) {
-        snprintf(port_str, sizeof(port_str), "-p %d ", opts->port);
+    if (host->opts.rotate) {
+        if (status == INSTALL_ADDED) {
+            state_forget_host(host->fleet->cache, &host->opts, time(NULL));
+            script_counts(out, "rotated", &added, &removed);
+            snprintf(text, sizeof(text), "keys rotated (+%d -%d)", added, removed);
+        }
+        fleet_report(host->fleet, &host->opts, status,
+                     status == INSTALL_ADDED ? text
+                     : status == INSTALL_PRESENT ? "already rotated" : NULL);
+        fleet_host_finish(host);
+        return;
     }
-    
-    if (opts->ssh_config[0] != '\0') {
-        snprintf(config_str, sizeof(config_str), "-F \"%s\" ", opts->ssh_config);
+    if (host->opts.sync && status == INSTALL_ADDED) {
+        sync_diff(host->key_content, out, &added, &removed, &kept);
+        if (removed > 0) {
+            state_forget_host(host->fleet->cache, &host->opts, time(NULL) - 1);
+        }
     }
-    
-    /* Create .ssh directory */
-    printf("Creating ~/.ssh directory...\n");
-    snprintf(cmd, sizeof(cmd), "ssh %s%s%s@%s \"mkdir -p ~/.ssh && chmod 700 ~/.ssh\"",
-             config_str, port_str, opts->user, opts->host);
-    system(cmd);
-    
-    if (opts->force) {
-        printf("Adding key to authorized_keys...\n");
-        snprintf(cmd, sizeof(cmd), "ssh %s%s%s@%s \"echo '%s' >> ~/.ssh/authorized_keys && chmod 600 ~/.ssh/authorized_keys\"",
-                 config_str, port_str, opts->user, opts->host, escaped_key);
-        return system(cmd);
+    if (ok) {
+        state_confirm(host->fleet->cache, host->state_id, out);
+    }
+    if (host->opts.sync && status == INSTALL_ADDED) {
+        snprintf(text, sizeof(text), kept ? "managed keys synced (+%d -%d, %d kept outside)"
+                                          : "managed keys synced (+%d -%d)", added, removed, kept);
+        fleet_report(host->fleet, &host->opts, status, text);
     } else {
-        /* Check for existing key */
-        char check_cmd[MAX_CMD_LEN];
-        snprintf(check_cmd, sizeof(check_cmd), "ssh %s%s%s@%s \"cat ~/.ssh/authorized_keys 2>/dev/null\"",
-                 config_str, port_str, opts->user, opts->host);
+        fleet_report(host->fleet, &host->opts, status, NULL);
+    }
+    fleet_host_finish(host);
+}
+
+/* Event loop callback for hosts handled by an ssh child */
+static void fleet_done(Job *job, void *ctx) {
+    fleet_host_done(ctx, job->status, &job->out, &job->err);
+}
+
+#ifdef USE_LIBSSH2
+/* Engine callback for hosts handled in-process */
+static void fleet_native_done(NativeJob *job, void *ctx) {
+    fleet_host_done(ctx, job->status, &job->out, &job->err);
+}
+#endif
+
+/* Hosts currently being installed */
+static int fleet_active(const Fleet *fleet) {
+#ifdef USE_LIBSSH2
+    return fleet->loop.active + fleet->native.active;
+#else
+    return fleet->loop.active;
+#endif
+}
+
+/*
+ * Start installs until opts->jobs are running or the targets run out.
+ * Targets are only read when a slot is free, which throttles the
+ * inventory reader. Hosts the state cache knows to have the key are
+ * only reported. A host that cannot be started while others are running
+ * (e.g. out of descriptors) waits for the next free slot.
+ */
+static void fleet_fill(Fleet *fleet) {
+    char key_path[MAX_PATH_LEN];
+    const unsigned char *fingerprint;
+    const StateRecord *known;
+    char check[256];
+    const char *script;
+    FleetHost *host;
+    int fetch;
+    int next;
+    
+    while ((fleet->deferred || !fleet->exhausted) && fleet_active(fleet) < fleet->base->jobs) {
+        if (fleet->deferred) {
+            host = fleet->deferred;
+            fleet->deferred = NULL;
+            goto start;
+        }
+        host = calloc(1, sizeof(FleetHost));
+        if (!host) {
+            fprintf(stderr, "Out of memory, not starting more hosts\n");
+            fleet->exhausted = 1;
+            break;
+        }
+        next = target_source_next(fleet->source, fleet->base, &host->opts);
+        if (next <= 0) {
+            free(host);
+            if (next == 0) {
+                fleet->exhausted = 1;
+            } else {
+                fleet_report(fleet, fleet->base, -1, NULL);
+            }
+            continue;
+        }
+        host->fleet = fleet;
         
-        FILE *fp = _popen(check_cmd, "r");
-        if (fp) {
-            char existing_keys[MAX_KEY_SIZE] = "";
-            size_t bytes_read = fread(existing_keys, 1, sizeof(existing_keys) - 1, fp);
-            existing_keys[bytes_read] = '\0';
-            _pclose(fp);
-            
-            if (strstr(existing_keys, key_content)) {
-                printf("Key already exists on server\n");
-                return 0;
+        /* An inventory line may name its own key */
+        host->key_content = fleet->key_content;
+        host->script = fleet->script;
+        fingerprint = fleet->fingerprint;
+        if (strcmp(host->opts.identity_file, fleet->base->identity_file) != 0 &&
+            !host->opts.rotate && !host->opts.audit) {
+            get_public_key_path(&host->opts, key_path, sizeof(key_path));
+            host->own_keys = fleet_keys(fleet, key_path);
+            if (!host->own_keys) {
+                fprintf(stderr, "%s@%s: cannot read public key %s\n",
+                        host->opts.user, host->opts.host, key_path);
+                fleet_report(fleet, &host->opts, -1, NULL);
+                free(host);
+                continue;
+            }
+            host->key_content = host->own_keys->content.data;
+            host->script = host->own_keys->script;
+            fingerprint = host->own_keys->fingerprint;
+        }
+        
+        state_id(&host->opts, fingerprint, host->state_id);
+        /* Two installs racing on one authorized_keys could both append */
+        if (fpset_add(&fleet->started, host->state_id, NULL) == 0) {
+            fprintf(stderr, "%s@%s: listed more than once, skipped\n",
+                    host->opts.user, host->opts.host);
+            fleet_host_free(host);
+            continue;
+        }
+        known = host->opts.force || host->opts.remove || host->opts.rotate || host->opts.audit ||
+                host->opts.check ? NULL : state_lookup(fleet->cache, &host->opts, host->state_id);
+        if (known && !host->opts.no_cache && !host->opts.sync) {
+            fleet_report(fleet, &host->opts, INSTALL_CACHED, NULL);
+            fleet_host_free(host);
+            continue;
+        }
+        /* Checked anyway: the host may still answer from its file's digest */
+        unchanged_check(known, check, sizeof(check));
+        if (check[0] != '\0') {
+            host->own_script = malloc(strlen(check) + strlen(host->script) + 1);
+            if (host->own_script) {
+                strcpy(host->own_script, check);
+                strcat(host->own_script, host->script);
+                host->script = host->own_script;
+            }
+        }
+        /* An audit only reads the file */
+        if (host->opts.audit) {
+            if (audit_host(fleet->audit, &host->opts, &host->audit_host) != 0) {
+                fprintf(stderr, "Out of memory, not starting more hosts\n");
+                fleet->exhausted = 1;
+                fleet_host_free(host);
+                break;
             }
+            keystream_init(&host->stream, fleet_audit_line, host);
+            host->phase = FLEET_FETCH;
+        }
+        /* Keys given by fingerprint are looked for in the file first */
+        if (host->opts.remove && fleet->fingerprints->count > 0) {
+            host->match.wanted = fleet->fingerprints;
+            host->match.lines = &host->payload;
+            keystream_init(&host->stream, keys_match, &host->match);
+            host->phase = FLEET_FETCH;
         }
+        script = host->phase == FLEET_FETCH ? FETCH_SCRIPT : host->script;
+        host->started = timing_start();
+        host->step_started = host->started;
+#ifdef USE_LIBSSH2
+        fetch = host->phase == FLEET_FETCH;
+        if (native_start(&fleet->native, &host->opts, script, fetch ? NULL : host->key_content,
+                         fetch ? 0 : strlen(host->key_content), fetch ? fleet_stream : NULL,
+                         fleet_native_done, host) == 0) {
+            continue;
+        }
+#endif
+        build_ssh_argv(&host->opts, NULL, script, &host->args);
         
-        printf("Adding key to authorized_keys...\n");
-        snprintf(cmd, sizeof(cmd), "ssh %s%s%s@%s \"echo '%s' >> ~/.ssh/authorized_keys && chmod 600 ~/.ssh/authorized_keys\"",
-                 config_str, port_str, opts->user, opts->host, escaped_key);
-        return system(cmd);
+start:
+        fetch = host->phase == FLEET_FETCH;
+        if (loop_spawn(&fleet->loop, host->args.argv, fetch ? NULL : host->key_content,
+                       fetch ? 0 : strlen(host->key_content), fetch ? fleet_stream : NULL,
+                       fleet_done, host) != 0) {
+            if (fleet_active(fleet) > 0) {
+                fleet->deferred = host;
+                break;
+            }
+            fprintf(stderr, "%s@%s: cannot start ssh\n", host->opts.user, host->opts.host);
+            fleet_report(fleet, &host->opts, -1, NULL);
+            fleet_host_free(host);
+        }
     }
 }
 
-/* Test connection */
-int test_connection(Options *opts) {
-    char cmd[MAX_CMD_LEN];
-    char port_str[32] = "";
-    char config_str[MAX_CMD_LEN] = "";
-    char private_key[MAX_PATH_LEN];
+/*
+ * Install the key on every target with at most opts->jobs concurrent
+ * ssh processes, all driven from this thread by one event loop. With
+ * USE_LIBSSH2 the hosts it can reach directly run in the non-blocking
+ * engine instead and the two are serviced in turn. Prints one result line
+ * per host and a summary; returns 0 only if every host ends up with the key
+ * (with --remove, without the keys; with --check, if every host has it).
+ */
+int run_fleet(Options *opts, TargetSource *source, const char *key_content,
+              const FpSet *fingerprints, Audit *audit, StateCache *cache) {
+    Fleet fleet;
+    int result;
+#ifndef _WIN32
+    struct rlimit limit;
+    rlim_t wanted = (rlim_t)opts->jobs * 4 + 64;
     
-    if (opts->port > 0 && opts->port != 22) {
-        snprintf(port_str, sizeof(port_str), "-p %d ", opts->port);
+    /* Every running host holds up to four descriptors */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur < wanted) {
+        limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > wanted
+                             ? wanted : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
     }
+#endif
     
-    if (opts->ssh_config[0] != '\0') {
-        snprintf(config_str, sizeof(config_str), "-F \"%s\" ", opts->ssh_config);
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.base = opts;
+    fleet.source = source;
+    fleet.key_content = key_content;
+    fleet.fingerprints = fingerprints;
+    fleet.audit = audit;
+    key_fingerprint(key_content, fleet.fingerprint);
+    fleet.cache = cache;
+    install_script(opts, key_content, NULL, fleet.script, sizeof(fleet.script));
+    if (loop_init(&fleet.loop) != 0) {
+        fprintf(stderr, "Error: Cannot set up the event loop\n");
+        return 1;
+    }
+#ifdef USE_LIBSSH2
+    /* Without the engine every host simply goes through ssh */
+    native_engine_init(&fleet.native);
+#endif
+    
+    fleet_fill(&fleet);
+    while (fleet_active(&fleet) > 0) {
+        result = 0;
+#ifdef USE_LIBSSH2
+        if (fleet.native.active > 0) {
+            result = native_run_once(&fleet.native, fleet.loop.active > 0 ? 10 : -1);
+        }
+        if (result == 0 && fleet.loop.active > 0) {
+            result = loop_run_once(&fleet.loop, fleet.native.active > 0 ? 10 : -1);
+        }
+#else
+        result = loop_run_once(&fleet.loop, -1);
+#endif
+        if (result != 0) {
+            fprintf(stderr, "Error: Event loop failed\n");
+            break;
+        }
+        fleet_fill(&fleet);
+    }
+    loop_free(&fleet.loop);
+#ifdef USE_LIBSSH2
+    native_engine_free(&fleet.native);
+#endif
+    fpset_free(&fleet.started);
+    keyset_release(fleet.inventory_keys);
+    
+    if ((!opts->quiet || fleet.failed) && opts->audit) {
+        fprintf(stderr, "%lu hosts: %d read, %d failed; %lu key lines, %lu distinct keys\n",
+                fleet.hosts, fleet.added, fleet.failed, (unsigned long)audit->entry_count,
+                (unsigned long)audit->keys.count);
+    } else if ((!opts->quiet || fleet.failed) && opts->remove) {
+        printf("%lu hosts: %d with keys removed (%lu lines), %d without them, %d failed\n",
+               fleet.hosts, fleet.added, fleet.removed, fleet.present, fleet.failed);
+    } else if ((!opts->quiet || fleet.failed || fleet.missing) && opts->check) {
+        printf("%lu hosts: %d with the key, %d without it, %d failed\n",
+               fleet.hosts, fleet.present, fleet.missing, fleet.failed);
+    } else if ((!opts->quiet || fleet.failed) && opts->rotate) {
+        printf("%lu hosts: %d rotated, %d already rotated, %d failed\n",
+               fleet.hosts, fleet.added, fleet.present, fleet.failed);
+    } else if (!opts->quiet || fleet.failed) {
+        printf(opts->sync ? "%lu hosts: %d synced, %d already in sync, %d failed\n"
+                          : "%lu hosts: %d added, %d already present, %d failed\n",
+               fleet.hosts, fleet.added, fleet.present, fleet.failed);
+    }
+    return fleet.failed || fleet.missing || fleet_active(&fleet) > 0 ? 1 : 0;
+}
+
+/*
+ * --audit: read authorized_keys from every target in parallel, print the
+ * inverted index as JSON on stdout and save it as a snapshot to
+ * --audit_file, by default ~/.ssh/ssh-copy-id.audit (if ~/.ssh exists).
+ * Returns 0 only if every host could be read.
+ */
+int run_audit(Options *opts, TargetSource *source) {
+    char path[MAX_PATH_LEN];
+    StateCache cache;
+    Audit audit;
+    int result;
+    
+    memset(&cache, 0, sizeof(cache));
+    memset(&audit, 0, sizeof(audit));
+    result = run_fleet(opts, source, "", NULL, &audit, &cache);
+    audit_sort(&audit);
+    audit_write_json(&audit, stdout);
+    fflush(stdout);
+    
+    audit_path(opts, path, sizeof(path));
+    if (path[0] != '\0' && audit_save(&audit, path) != 0) {
+        fprintf(stderr, "Cannot write audit file: %s\n", path);
+        result = 1;
+    } else if (path[0] != '\0' && !opts->quiet) {
+        fprintf(stderr, "Audit saved to %s\n", path);
     }
+    audit_free(&audit);
+    return result;
+}
+
+/* Test connection */
+int test_connection(Options *opts) {
+    char private_key[MAX_PATH_LEN];
+    /*
+     * This login must authenticate with the key on its own, so it bypasses
+     * the master connection: a multiplexed session would always succeed.
+     */
+    const char *extra[] = { "-i", private_key, "-o", "BatchMode=yes",
+                            "-o", "ControlPath=none", NULL };
+    SshArgv args;
+    double started = timing_start();
+    int result;
     
     get_public_key_path(opts, private_key, sizeof(private_key));
     char *pub_pos = strstr(private_key, ".pub");
@@ -311,19 +6784,33 @@ int test_connection(Options *opts) {
     }
     
     printf("Testing connection with key...\n");
-    snprintf(cmd, sizeof(cmd), "ssh %s%s-i \"%s\" -o BatchMode=yes %s@%s \"exit 0\"",
-             config_str, port_str, private_key, opts->user, opts->host);
+#ifdef USE_LIBSSH2
+    /* A fresh session: the key must authenticate on its own */
+    result = native_run(opts, private_key, "exit 0", NULL, 0, NULL);
+    if (result != NATIVE_UNAVAILABLE) {
+        timing_end(PHASE_VERIFY, started);
+        return result;
+    }
+#endif
+    build_ssh_argv(opts, extra, "exit 0", &args);
     
-    return system(cmd);
+    result = run_process(args.argv, NULL, 0, CHILD_INHERIT, NULL);
+    timing_end(PHASE_VERIFY, started);
+    return result;
 }
 
-/* Parse command line arguments */
-int parse_args(int argc, char *argv[], Options *opts) {
+/*
+ * Parse command line arguments. Every -i goes to key_files; the first is
+ * also opts->identity_file, the key the final login test uses.
+ */
+int parse_args(int argc, char *argv[], Options *opts, TargetList *targets,
+               TargetList *key_files) {
     int i;
     int target_found = 0;
     
     memset(opts, 0, sizeof(Options));
     opts->port = 22;
+    opts->jobs = DEFAULT_JOBS;
     strcpy(opts->ssh_options, "");
     
     for (i = 1; i < argc; i++) {
@@ -333,7 +6820,13 @@ int parse_args(int argc, char *argv[], Options *opts) {
         }
         else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--identity_file") == 0) {
             if (i + 1 < argc) {
-                strncpy(opts->identity_file, argv[++i], sizeof(opts->identity_file) - 1);
+                if (target_list_add(key_files, argv[++i]) != 0) {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                if (key_files->count == 1) {
+                    strncpy(opts->identity_file, argv[i], sizeof(opts->identity_file) - 1);
+                }
             }
         }
         else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) {
@@ -360,9 +6853,109 @@ int parse_args(int argc, char *argv[], Options *opts) {
                 strncpy(opts->ssh_config, argv[++i], sizeof(opts->ssh_config) - 1);
             }
         }
-        else if (argv[i][0] != '-' && !target_found) {
-            parse_target(argv[i], opts);
+        else if (strcmp(argv[i], "--no_mux") == 0) {
+            opts->no_mux = 1;
+        }
+        else if (strcmp(argv[i], "--no_cache") == 0) {
+            opts->no_cache = 1;
+        }
+        else if (strcmp(argv[i], "--sync") == 0) {
+            /* The key set to sync to; more keys may come with -i */
+            if (i + 1 < argc) {
+                if (target_list_add(key_files, argv[++i]) != 0) {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                if (key_files->count == 1) {
+                    strncpy(opts->identity_file, argv[i], sizeof(opts->identity_file) - 1);
+                }
+            }
+            opts->sync = 1;
+        }
+        else if (strcmp(argv[i], "--remove") == 0) {
+            /* A key, bundle, directory or SHA256: fingerprint to remove */
+            if (i + 1 < argc) {
+                if (target_list_add(key_files, argv[++i]) != 0) {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                if (key_files->count == 1) {
+                    strncpy(opts->identity_file, argv[i], sizeof(opts->identity_file) - 1);
+                }
+            }
+            opts->remove = 1;
+        }
+        else if (strcmp(argv[i], "--rotate") == 0) {
+            /* The key to retire, then its replacement; -i may add more new keys */
+            if (i + 2 >= argc) {
+                fprintf(stderr, "--rotate needs the old and the new key\n");
+                return -1;
+            }
+            strncpy(opts->rotate_from, argv[++i], sizeof(opts->rotate_from) - 1);
+            if (target_list_add(key_files, argv[++i]) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
+            if (key_files->count == 1) {
+                strncpy(opts->identity_file, argv[i], sizeof(opts->identity_file) - 1);
+            }
+            opts->rotate = 1;
+        }
+        else if (strcmp(argv[i], "--audit") == 0) {
+            opts->audit = 1;
+        }
+        else if (strcmp(argv[i], "--audit_file") == 0) {
+            if (i + 1 < argc) {
+                strncpy(opts->audit_file, argv[++i], sizeof(opts->audit_file) - 1);
+            }
+        }
+        else if (strcmp(argv[i], "--check") == 0) {
+            opts->check = 1;
+        }
+        else if (strcmp(argv[i], "--timings") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "table") == 0) {
+                    opts->timings = TIMINGS_TABLE;
+                } else if (strcmp(argv[i], "json") == 0) {
+                    opts->timings = TIMINGS_JSON;
+                } else {
+                    fprintf(stderr, "--timings must be table or json\n");
+                    return -1;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--where_is") == 0) {
+            if (i + 1 < argc) {
+                strncpy(opts->where_is, argv[++i], sizeof(opts->where_is) - 1);
+            }
+        }
+        else if (strcmp(argv[i], "--keys_on") == 0) {
+            if (i + 1 < argc) {
+                strncpy(opts->keys_on, argv[++i], sizeof(opts->keys_on) - 1);
+            }
+        }
+        else if (strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--hosts_file") == 0) {
+            if (i + 1 < argc) {
+                strncpy(opts->hosts_file, argv[++i], sizeof(opts->hosts_file) - 1);
+            }
+        }
+        else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                opts->jobs = atoi(argv[++i]);
+                if (opts->jobs < 1 || opts->jobs > MAX_JOBS) {
+                    fprintf(stderr, "Jobs must be between 1 and %d\n", MAX_JOBS);
+                    return -1;
+                }
+            }
+        }
+        else if (argv[i][0] != '-') {
+            /* Parsed later: in fleet mode opts stays the per-host template */
             target_found = 1;
+            if (target_list_add(targets, argv[i]) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
         }
         else {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
@@ -371,7 +6964,21 @@ int parse_args(int argc, char *argv[], Options *opts) {
         }
     }
     
-    if (!target_found && opts->host[0] == '\0') {
+    if (opts->sync + opts->remove + opts->rotate + opts->audit + opts->check > 1) {
+        fprintf(stderr, "Only one of --sync, --remove, --rotate, --audit and --check can be used\n");
+        return -1;
+    }
+    
+    /* Questions about the saved audit need no host */
+    if (opts->where_is[0] != '\0' || opts->keys_on[0] != '\0') {
+        if (opts->where_is[0] != '\0' && opts->keys_on[0] != '\0') {
+            fprintf(stderr, "Only one of --where_is and --keys_on can be used\n");
+            return -1;
+        }
+        return 0;
+    }
+    
+    if (!target_found && opts->hosts_file[0] == '\0') {
         fprintf(stderr, "No host specified. Usage: %s user@host\n", argv[0]);
         print_help(argv[0]);
         return -1;
@@ -382,92 +6989,247 @@ int parse_args(int argc, char *argv[], Options *opts) {
 
 int main(int argc, char *argv[]) {
     Options opts;
+    TargetList targets = { NULL, 0, 0 };
+    TargetList key_files = { NULL, 0, 0 };
+    TargetSource source;
+    Options host_opts;
     char key_path[MAX_PATH_LEN];
-    char key_content[MAX_KEY_SIZE];
+    Buffer key_content = { NULL, 0, 0, NULL, NULL };
+    FpSet fingerprints;
+    StateCache cache;
+    const char *to;
+    double started;
+    size_t i = 0;
+    int fleet_mode;
+    int found;
+    int keys;
     int result;
     
+#ifdef _WIN32
     /* Initialize Winsock */
     WSADATA wsaData;
     WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+    /* A remote side that exits early must not kill us while we write its stdin */
+    signal(SIGPIPE, SIG_IGN);
+#endif
     
     /* Parse arguments */
-    if (parse_args(argc, argv, &opts) != 0) {
+    if (parse_args(argc, argv, &opts, &targets, &key_files) != 0) {
+        WSACleanup();
+        return 1;
+    }
+    if (opts.timings) {
+        timings_init(opts.timings);
+    }
+    
+    if (opts.where_is[0] != '\0') {
+        WSACleanup();
+        return where_is(&opts);
+    }
+    if (opts.keys_on[0] != '\0') {
+        WSACleanup();
+        return keys_on(&opts);
+    }
+    
+    memset(&source, 0, sizeof(source));
+    source.args = &targets;
+    if (opts.hosts_file[0] != '\0') {
+        source.inventory_path = opts.hosts_file;
+        source.inventory = fopen(opts.hosts_file, "r");
+        if (!source.inventory) {
+            fprintf(stderr, "Cannot read hosts file: %s\n", opts.hosts_file);
+            WSACleanup();
+            return 1;
+        }
+    }
+    fleet_mode = targets.count > 1 || source.inventory;
+    if (!fleet_mode && parse_target(targets.items[0], &opts) != 0) {
+        fprintf(stderr, "Invalid target: %s\n", targets.items[0]);
         WSACleanup();
         return 1;
     }
     
     /* Check SSH client */
-    if (!check_ssh_installed()) {
+    started = timing_start();
+#ifdef USE_LIBSSH2
+    found = (!fleet_mode && native_usable(&opts)) || check_ssh_installed();
+#else
+    found = check_ssh_installed();
+#endif
+    timing_end(PHASE_SSH_CHECK, started);
+    if (!found) {
         fprintf(stderr, "SSH client not found. Please install OpenSSH for Windows.\n");
         WSACleanup();
         return 1;
     }
     
-    /* Get key path */
-    get_public_key_path(&opts, key_path, sizeof(key_path));
+    /* An audit reads no keys, and its report is stdout */
+    if (opts.audit) {
+        if (opts.dry_run) {
+            while ((result = target_source_next(&source, &opts, &host_opts)) != 0) {
+                if (result > 0) {
+                    printf("[DRY RUN] Would read %s@%s:~/.ssh/authorized_keys\n",
+                           host_opts.user, host_opts.host);
+                }
+            }
+            result = 0;
+        } else {
+            result = run_audit(&opts, &source);
+        }
+        if (source.inventory) {
+            fclose(source.inventory);
+        }
+        WSACleanup();
+        return result;
+    }
     
     if (!opts.quiet) {
-        printf("Copying key: %s\n", key_path);
-        printf("To server: %s@%s", opts.user, opts.host);
-        if (opts.port > 0 && opts.port != 22) {
-            printf(":%d", opts.port);
+        if (opts.rotate) {
+            identity_key_path(opts.rotate_from, key_path, sizeof(key_path));
+            printf("Retiring key: %s\n", key_path);
+        }
+        do {
+            if (opts.remove && strncmp(key_files.items[i], "SHA256:", 7) == 0) {
+                snprintf(key_path, sizeof(key_path), "%s", key_files.items[i]);
+            } else {
+                identity_key_path(key_files.count ? key_files.items[i] : "", key_path,
+                                  sizeof(key_path));
+            }
+            printf("%s key: %s\n", opts.remove ? "Removing" : opts.check ? "Checking" : "Copying",
+                   key_path);
+        } while (++i < key_files.count);
+        to = opts.remove ? "From" : opts.check ? "On" : "To";
+        if (source.inventory && targets.count > 0) {
+            printf("%s %lu host(s) and the hosts in %s, %d at a time\n",
+                   to, (unsigned long)targets.count, opts.hosts_file, opts.jobs);
+        } else if (source.inventory) {
+            printf("%s the hosts in %s, %d at a time\n", to, opts.hosts_file, opts.jobs);
+        } else if (fleet_mode) {
+            printf("%s %lu hosts, %d at a time\n", to, (unsigned long)targets.count, opts.jobs);
+        } else {
+            printf("%s server: %s@%s", to, opts.user, opts.host);
+            if (opts.port > 0 && opts.port != 22) {
+                printf(":%d", opts.port);
+            }
+            printf("\n");
         }
-        printf("\n");
     }
     
     /* Dry run */
     if (opts.dry_run) {
-        printf("[DRY RUN] Key would be added to ~/.ssh/authorized_keys\n");
+        to = opts.sync ? "Managed keys would be synced in"
+             : opts.remove ? "Keys would be removed from"
+             : opts.rotate ? "Keys would be rotated in"
+             : opts.check ? "Key would be looked for in" : "Key would be added to";
+        if (fleet_mode) {
+            while ((result = target_source_next(&source, &opts, &host_opts)) != 0) {
+                if (result > 0) {
+                    printf("[DRY RUN] %s %s@%s:~/.ssh/authorized_keys\n",
+                           to, host_opts.user, host_opts.host);
+                }
+            }
+        } else {
+            printf("[DRY RUN] %s ~/.ssh/authorized_keys\n", to);
+        }
         WSACleanup();
         return 0;
     }
     
-    /* Read public key */
-    if (read_public_key(key_path, key_content, sizeof(key_content)) != 0) {
-        fprintf(stderr, "Public key not found: %s\n", key_path);
-        
-        char private_key[MAX_PATH_LEN];
-        strncpy(private_key, key_path, sizeof(private_key) - 1);
-        char *pub_pos = strstr(private_key, ".pub");
-        if (pub_pos) {
-            *pub_pos = '\0';
+    /* Read public keys */
+    started = timing_start();
+    memset(&fingerprints, 0, sizeof(fingerprints));
+    if (opts.remove) {
+        keys = load_removals(&key_files, &key_content, &fingerprints);
+    } else if (opts.rotate) {
+        keys = load_rotation(opts.rotate_from, &key_files, &key_content);
+    } else {
+        keys = load_public_keys(&key_files, &key_content);
+    }
+    timing_end(PHASE_KEY_READ, started);
+    if (keys < 0) {
+        WSACleanup();
+        return 1;
+    }
+    if (!opts.quiet && keys > 1) {
+        printf("%d distinct keys\n", keys);
+    }
+    
+    /* A check only reads: the state cache is neither used nor updated */
+    if (opts.check) {
+        memset(&cache, 0, sizeof(cache));
+        result = fleet_mode ? run_fleet(&opts, &source, key_content.data, &fingerprints, NULL, &cache)
+                            : check_on_server(&opts, key_content.data);
+        if (source.inventory) {
+            fclose(source.inventory);
         }
-        
-        if (file_exists(private_key)) {
-            fprintf(stderr, "Private key found: %s\n", private_key);
-            fprintf(stderr, "Generate public key: ssh-keygen -y -f %s > %s\n", 
-                    private_key, key_path);
+        buffer_free(&key_content);
+        if (result == SSH_CONNECT_FAILED) {
+            fprintf(stderr, "Failed to connect to server. Check login credentials.\n");
+        } else if (!fleet_mode && result != 0 && result != 1) {
+            fprintf(stderr, "Error checking key\n");
         }
-        
         WSACleanup();
-        return 1;
+        return result == 0 ? 0 : 1;
     }
     
-    /* Test connection */
-    if (!opts.quiet) {
-        printf("Testing connection...\n");
+    /* Without a state file every host is simply contacted */
+    state_open(&cache);
+    
+    if (fleet_mode) {
+        result = run_fleet(&opts, &source, key_content.data, &fingerprints, NULL, &cache);
+        if (source.inventory) {
+            fclose(source.inventory);
+        }
+        state_close(&cache);
+        WSACleanup();
+        return result;
     }
     
-    result = run_ssh_command(&opts, "exit 0");
-    if (result != 0) {
-        fprintf(stderr, "Failed to connect to server. Check login credentials.\n");
+    if (opts.remove) {
+        result = remove_from_server(&opts, key_content.data, &fingerprints, &cache);
+        buffer_free(&key_content);
+        fpset_free(&fingerprints);
+        state_close(&cache);
+        if (result == SSH_CONNECT_FAILED) {
+            fprintf(stderr, "Failed to connect to server. Check login credentials.\n");
+        } else if (result != 0) {
+            fprintf(stderr, "Error removing key\n");
+        }
         WSACleanup();
-        return 1;
+        return result == 0 ? 0 : 1;
     }
     
     /* Copy key */
-    result = copy_key_to_server(&opts, key_content);
+    result = opts.rotate ? rotate_on_server(&opts, key_content.data, &cache)
+                         : copy_key_to_server(&opts, key_content.data, &cache);
+    buffer_free(&key_content);
+    state_close(&cache);
+    
+    if (result == INSTALL_CACHED || result == INSTALL_UNCHANGED || (result == 0 && opts.sync)) {
+        /* Nothing to test: unchanged, or a set of keys rather than one */
+        WSACleanup();
+        return 0;
+    }
     
     if (result == 0) {
         if (!opts.quiet) {
-            printf("Key copied successfully!\n");
+            printf(opts.rotate ? "Key rotated successfully!\n" : "Key copied successfully!\n");
             
-            if (test_connection(&opts) == 0) {
-                printf("Connection with key works!\n");
-            } else {
-                printf("Connection with key failed.\n");
+            /* A key bundle or directory has no one private key to test with */
+            get_public_key_path(&opts, key_path, sizeof(key_path));
+            if (strstr(key_path, ".pub") && !is_directory(key_path)) {
+                if (test_connection(&opts) == 0) {
+                    printf("Connection with key works!\n");
+                } else {
+                    printf("Connection with key failed.\n");
+                }
             }
         }
+    } else if (result == SSH_CONNECT_FAILED) {
+        fprintf(stderr, "Failed to connect to server. Check login credentials.\n");
+        WSACleanup();
+        return 1;
     } else {
         fprintf(stderr, "Error copying key\n");
         WSACleanup();
@@ -0,0 +1,130 @@
+#!/bin/sh
+# Install, check, remove and sync a key through a throwaway sshd on
+# 127.0.0.1. The server runs as the current user with its own host key and
+# config, and ForceCommand points HOME at a scratch directory, so neither
+# the real ~/.ssh/authorized_keys nor the local state cache is touched.
+# Without sshd the run is skipped.
+#
+#   make loopback
+#   SSHD=/usr/sbin/sshd PORT=22022 sh tests/loopback.sh
+
+set -u
+BIN=${BIN:-./ssh-copy-id}
+SSHD=${SSHD:-$(command -v sshd || echo /usr/sbin/sshd)}
+PORT=${PORT:-22022}
+
+if [ ! -x "$SSHD" ]; then
+    echo "loopback: no sshd, skipped"
+    exit 0
+fi
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/ssh-copy-id-loopback.XXXXXX") || exit 1
+pid=
+failures=0
+
+cleanup() {
+    [ -n "$pid" ] && kill "$pid" 2> /dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+check() {
+    if "$@"; then
+        :
+    else
+        echo "loopback: failed: $*" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+mkdir -p "$dir/home/.ssh" "$dir/local/.ssh"
+ssh-keygen -q -t ed25519 -N '' -f "$dir/host_key" || exit 1
+ssh-keygen -q -t ed25519 -N '' -C boot -f "$dir/boot" || exit 1
+ssh-keygen -q -t ed25519 -N '' -C new -f "$dir/new" || exit 1
+cp "$dir/boot.pub" "$dir/boot_keys"
+
+# The first login of every run uses the boot key, which lives outside
+# the file under test
+cat > "$dir/sshd_config" <<EOF
+ListenAddress 127.0.0.1
+Port $PORT
+HostKey $dir/host_key
+PidFile $dir/sshd.pid
+AuthorizedKeysFile $dir/boot_keys $dir/home/.ssh/authorized_keys
+StrictModes no
+UsePAM no
+PasswordAuthentication no
+KbdInteractiveAuthentication no
+ForceCommand HOME=$dir/home; export HOME; cd; eval "\$SSH_ORIGINAL_COMMAND"
+EOF
+
+cat > "$dir/ssh_config" <<EOF
+Host loopback
+    HostName 127.0.0.1
+    Port $PORT
+    IdentityFile $dir/boot
+    IdentitiesOnly yes
+    UserKnownHostsFile $dir/known_hosts
+    StrictHostKeyChecking accept-new
+EOF
+
+"$SSHD" -D -e -f "$dir/sshd_config" 2> "$dir/sshd.log" &
+pid=$!
+
+# Logs in with the new key alone: is it really trusted?
+new_key_works() {
+    ssh -F /dev/null -p "$PORT" -i "$dir/new" -o IdentitiesOnly=yes -o BatchMode=yes \
+        -o UserKnownHostsFile="$dir/known_hosts" -o StrictHostKeyChecking=accept-new \
+        "$user@127.0.0.1" exit 0 2> /dev/null
+}
+
+lines() {
+    [ "$(grep -c "$1" "$dir/home/.ssh/authorized_keys" 2> /dev/null)" = "$2" ]
+}
+
+sci() {
+    HOME=$dir/local "$BIN" -F "$dir/ssh_config" "$@" > "$dir/out" 2>&1
+}
+
+user=$(id -un)
+tries=0
+until ssh -F "$dir/ssh_config" -o BatchMode=yes "$user@loopback" exit 0 2> /dev/null; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ] || ! kill -0 "$pid" 2> /dev/null; then
+        echo "loopback: sshd did not come up:" >&2
+        cat "$dir/sshd.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+fingerprint=$(ssh-keygen -l -f "$dir/new.pub" | awk '{ print $2 }')
+
+check sci -i "$dir/new.pub" "$user@loopback"
+check new_key_works
+check lines "new$" 1
+
+check sci --no_cache -i "$dir/new.pub" "$user@loopback"
+check grep -q "already exists" "$dir/out"
+check lines "new$" 1
+
+check sci --check -i "$dir/new.pub" "$user@loopback"
+
+# By fingerprint: the fetch and the removal share one master connection
+check sci --remove "$fingerprint" "$user@loopback"
+check lines "new$" 0
+if new_key_works; then
+    echo "loopback: failed: the removed key still logs in" >&2
+    failures=$((failures + 1))
+fi
+
+check sci --sync "$dir/new.pub" "$user@loopback"
+check new_key_works
+check grep -q "^# BEGIN" "$dir/home/.ssh/authorized_keys"
+
+if [ $failures -ne 0 ]; then
+    echo "loopback: $failures checks failed" >&2
+    exit 1
+fi
+echo "loopback: all checks passed"
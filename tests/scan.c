@@ -0,0 +1,94 @@
+/*
+ * The SSE2 and AVX2 scanners must stop where the scalar ones do.
+ * Random buffers mix base64, newlines, blanks, '=' and bytes above 0x7f,
+ * and every start offset is scanned to every end up to a few blocks
+ * away, so short runs, whole blocks and the re-tested tail of
+ * SCAN_BLOCKS are all compared. Exits 1 at the first difference.
+ *
+ *   make test
+ */
+
+/* The program's own main() is not wanted here */
+#define main ssh_copy_id_main
+#include "../ssh-copy-id.c"
+#undef main
+
+#define SCAN_TEST_BUFFERS 300
+#define SCAN_TEST_LEN 160
+
+static uint32_t scan_seed = 2463534242u;
+
+/* xorshift32: the same buffers on every run */
+static uint32_t scan_random(void) {
+    scan_seed ^= scan_seed << 13;
+    scan_seed ^= scan_seed >> 17;
+    scan_seed ^= scan_seed << 5;
+    return scan_seed;
+}
+
+/* Long base64 runs with the occasional byte that ends one */
+static void scan_fill(char *buf, size_t len) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const char stops[] = { '\n', ' ', '\t', '=', '\r', '"', (char)0x80, (char)0xff, '\0' };
+    unsigned rarity = 4 + scan_random() % 60;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        if (scan_random() % rarity == 0) {
+            buf[i] = stops[scan_random() % sizeof(stops)];
+        } else {
+            buf[i] = alphabet[scan_random() & 63];
+        }
+    }
+}
+
+#ifdef HAVE_SCAN_SIMD
+static int scan_compare(const char *what, const Scanner *scanner, const char *p, const char *end,
+                        const char *want, const char *got) {
+    if (got == want) {
+        return 0;
+    }
+    fprintf(stderr, "%s %s: run of %d bytes, stopped at %d instead of %d\n",
+            scanner->name, what, (int)(end - p), (int)(got - p), (int)(want - p));
+    return 1;
+}
+
+static int scan_check(const Scanner *scanner, const char *buf, size_t len) {
+    const char *p;
+    const char *end;
+    
+    for (p = buf; p <= buf + len; p++) {
+        for (end = p; end <= buf + len; end++) {
+            if (scan_compare("newline", scanner, p, end, scan_newline_scalar(p, end),
+                             scanner->newline(p, end)) ||
+                scan_compare("base64", scanner, p, end, scan_base64_scalar(p, end),
+                             scanner->base64(p, end))) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+int main(void) {
+#ifdef HAVE_SCAN_SIMD
+    char buf[SCAN_TEST_LEN];
+    int avx2 = cpu_has_avx2();
+    int i;
+    
+    for (i = 0; i < SCAN_TEST_BUFFERS; i++) {
+        scan_fill(buf, sizeof(buf));
+        if (scan_check(&scanner_sse2, buf, sizeof(buf)) ||
+            (avx2 && scan_check(&scanner_avx2, buf, sizeof(buf)))) {
+            return 1;
+        }
+    }
+    printf("scan: sse2%s match scalar on %d buffers\n", avx2 ? " and avx2" : "",
+           SCAN_TEST_BUFFERS);
+#else
+    printf("scan: scalar only, nothing to compare\n");
+#endif
+    return 0;
+}
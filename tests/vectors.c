@@ -0,0 +1,304 @@
+/*
+ * Fixed vectors for the parts whose output other tools must agree with:
+ * fingerprints as ssh-keygen -l prints them, cksum(1) values, the
+ * authorized_keys parser (quoted options, CRLF, lines split across
+ * stream chunks) and a saved audit read back through --where_is.
+ * Prints each failed check and exits 1 if there was any.
+ *
+ *   make test
+ */
+
+/* The program's own main() is not wanted here */
+#define main ssh_copy_id_main
+#include "../ssh-copy-id.c"
+#undef main
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* Keys made by ssh-keygen, with what ssh-keygen -l printed for them */
+static const struct {
+    const char *line;
+    const char *fingerprint;
+} key_vectors[] = {
+    { "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov"
+      " alice@laptop",
+      "SHA256:maoUjKdH9InoEmZ/SSkxrHCmLETe9IY6U1u0xYrTlVM" },
+    { "ecdsa-sha2-nistp256 AAAAE2VjZHNhLXNoYTItbmlzdHAyNTYAAAAIbmlzdHAyNTYAAABBBPf1BXG8MkGH"
+      "0M+P75pNLBi1hnf33Yy4TGXhMvKwyT3QsJ0ukdOKhs8wWA+8nePJzmNw4/Iu6ivJV9INsTDT0Wg= ci",
+      "SHA256:C8FfUGcOFOVUoZKbUULnUYTf8rF4Dthxowwewni4wxk" },
+    { "ssh-rsa AAAAB3NzaC1yc2EAAAADAQABAAABAQC76wV8kW4Kq6jKDdKtdTJukHK1WN1YEr7por/fTYpOPfqj"
+      "0dbj27S/Cz3Cm5HFO7ZZeu8PYHK+vSUNxL9OVp3HDEDsPjNTZ1FwvNrJTobHcL91RYRgY4w6d/N+hOh19joMu"
+      "gmvjdfxbmoNdpIYA/O2as+6Qunhk7EdEBVNAvQvBE0VByakU4uOFVOJUtytvpMik7fNqbxMO5g7UmRjAlBcp4"
+      "qL6+9MfW9rI2BJDri/vjC62Y7pKxWigDOuHRm0PZFjDQ3+fN++0mE3T0j1B0o2rBvn5oC5KDixfwd4/4/b5l"
+      "Jpf+hFiQ/OIl31r52SDJDYNpx6EDzCsf7hwsro1/L7 bob@build",
+      "SHA256:lY5BAdfh/Sl8JeTxh1a8hwvgTxmt8YrFBefDC5ho8nY" },
+};
+
+#define KEY_VECTORS (sizeof(key_vectors) / sizeof(key_vectors[0]))
+
+static int view_is(StrView v, const char *text) {
+    return v.len == strlen(text) && memcmp(v.ptr, text, v.len) == 0;
+}
+
+static void test_base64(void) {
+    unsigned char out[16];
+    
+    CHECK(base64_decode("AAAAC3NzaC1lZDI1NTE5", 20, out) == 15);
+    CHECK(memcmp(out, "\0\0\0\013ssh-ed25519", 15) == 0);
+    CHECK(base64_decode("YQ==", 4, out) == 1 && out[0] == 'a');
+    CHECK(base64_decode("YWI=", 4, out) == 2 && memcmp(out, "ab", 2) == 0);
+    CHECK(base64_decode("YWJj", 4, out) == 3 && memcmp(out, "abc", 3) == 0);
+    CHECK(base64_decode("YQ", 2, out) == -1);
+    CHECK(base64_decode("Y=Q=", 4, out) == -1);
+    CHECK(base64_decode("YQ==YQ==", 8, out) == -1);
+    CHECK(base64_decode("Y-Q=", 4, out) == -1);
+}
+
+static void test_fingerprints(void) {
+    unsigned char digest[SHA256_LEN];
+    unsigned char parsed[SHA256_LEN];
+    char text[FINGERPRINT_TEXT_LEN];
+    KeyParser parser;
+    KeyLine key;
+    size_t i;
+    
+    for (i = 0; i < KEY_VECTORS; i++) {
+        keys_init(&parser, key_vectors[i].line, strlen(key_vectors[i].line));
+        CHECK(keys_next(&parser, &key) && key.kind == KEYLINE_KEY);
+        CHECK(blob_fingerprint(key.blob, digest) == 0);
+        fingerprint_text(digest, text);
+        CHECK(strcmp(text, key_vectors[i].fingerprint) == 0);
+        CHECK(parse_fingerprint(key_vectors[i].fingerprint, parsed) == 0 &&
+              memcmp(parsed, digest, SHA256_LEN) == 0);
+        CHECK(key_fingerprint(key_vectors[i].line, parsed) == 0 &&
+              memcmp(parsed, digest, SHA256_LEN) == 0);
+    }
+    CHECK(parse_fingerprint("SHA256:maoUjKdH9InoEmZ/SSkxrHCmLETe9IY6U1u0xYrTlV", parsed) != 0);
+    CHECK(parse_fingerprint("MD5:maoUjKdH9InoEmZ/SSkxrHCmLETe9IY6U1u0xYrTlVM", parsed) != 0);
+}
+
+/* What cksum(1) printed for these inputs */
+static void test_cksum(void) {
+    static const struct {
+        const char *data;
+        unsigned long sum;
+    } vectors[] = {
+        { "", 4294967295UL },
+        { "a", 1220704766UL },
+        { "123456789", 930766865UL },
+        { "ssh-ed25519 AAAA x\n", 2647418043UL },
+    };
+    char block[1000];
+    uint32_t crc = 0;
+    size_t i;
+    
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        CHECK(cksum_final(cksum_update(0, vectors[i].data, strlen(vectors[i].data)),
+                          strlen(vectors[i].data)) == vectors[i].sum);
+    }
+    /* 100000 'k' bytes, in pieces as they arrive from the server */
+    memset(block, 'k', sizeof(block));
+    for (i = 0; i < 100; i++) {
+        crc = cksum_update(crc, block, sizeof(block));
+    }
+    CHECK(cksum_final(crc, 100000) == 3735319240UL);
+}
+
+/* An authorized_keys with CRLF ends, quoted options and odd lines */
+static const char parser_input[] =
+    "command=\"echo \\\"a,b\\\" # x\",no-pty ssh-ed25519 "
+    "AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov alice@laptop\r\n"
+    "  # ssh-ed25519 AAAAC3NzaC1lZDI1NTE5 commented out\r\n"
+    "\r\n"
+    "cert-authority,principals=\"ops,dev\" ecdsa-sha2-nistp256 "
+    "AAAAE2VjZHNhLXNoYTItbmlzdHAyNTYAAAAIbmlzdHAyNTYAAABBBPf1BXG8MkGH"
+    "0M+P75pNLBi1hnf33Yy4TGXhMvKwyT3QsJ0ukdOKhs8wWA+8nePJzmNw4/Iu6ivJV9INsTDT0Wg=\r\n"
+    "from=\"10.0.0.1\"\tssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov"
+    "  two words  \n"
+    "command=\"unterminated ssh-ed25519 AAAAC3NzaC1lZDI1NTE5\n"
+    "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov";
+
+#define PARSER_LINES 7
+
+static const int parser_kinds[PARSER_LINES] = {
+    KEYLINE_KEY, KEYLINE_COMMENT, KEYLINE_BLANK, KEYLINE_KEY, KEYLINE_KEY, KEYLINE_INVALID,
+    KEYLINE_KEY
+};
+
+static void test_parser(void) {
+    KeyParser parser;
+    KeyLine key;
+    int n = 0;
+    
+    keys_init(&parser, parser_input, strlen(parser_input));
+    while (keys_next(&parser, &key)) {
+        CHECK(n < PARSER_LINES && key.kind == parser_kinds[n]);
+        CHECK(key.line_no == (unsigned long)n + 1);
+        CHECK(key.line.len == 0 || key.line.ptr[key.line.len - 1] != '\r');
+        switch (n++) {
+        case 0:
+            CHECK(view_is(key.options, "command=\"echo \\\"a,b\\\" # x\",no-pty"));
+            CHECK(view_is(key.type, "ssh-ed25519"));
+            CHECK(view_is(key.comment, "alice@laptop"));
+            CHECK(!key.cert_authority);
+            break;
+        case 3:
+            CHECK(view_is(key.options, "cert-authority,principals=\"ops,dev\""));
+            CHECK(view_is(key.type, "ecdsa-sha2-nistp256"));
+            CHECK(key.comment.len == 0);
+            CHECK(key.cert_authority);
+            break;
+        case 4:
+            CHECK(view_is(key.options, "from=\"10.0.0.1\""));
+            CHECK(view_is(key.comment, "two words"));
+            break;
+        case 6:
+            CHECK(key.options.len == 0 && key.comment.len == 0);
+            CHECK(view_is(key.blob, "AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov"));
+            break;
+        }
+    }
+    CHECK(n == PARSER_LINES);
+}
+
+typedef struct {
+    int kinds[PARSER_LINES + 1];
+    int count;
+} StreamSeen;
+
+static void stream_line(const KeyLine *key, void *ctx) {
+    StreamSeen *seen = ctx;
+    
+    if (seen->count <= PARSER_LINES) {
+        seen->kinds[seen->count] = key->kind;
+    }
+    seen->count++;
+}
+
+/* The same lines must come out wherever the stream is cut, even inside "\r\n" */
+static void test_stream(void) {
+    size_t len = strlen(parser_input);
+    StreamSeen seen;
+    KeyStream stream;
+    size_t cut;
+    int i;
+    
+    for (cut = 0; cut <= len; cut++) {
+        memset(&seen, 0, sizeof(seen));
+        keystream_init(&stream, stream_line, &seen);
+        keystream_feed(&stream, parser_input, cut);
+        keystream_feed(&stream, parser_input + cut, len - cut);
+        keystream_end(&stream);
+        CHECK(seen.count == PARSER_LINES);
+        for (i = 0; i < PARSER_LINES && i < seen.count; i++) {
+            CHECK(seen.kinds[i] == parser_kinds[i]);
+        }
+    }
+}
+
+/* Run where_is() with its stdout captured in `out` */
+static int where_is_output(const Options *opts, const char *path, char *out, size_t size) {
+    FILE *fp;
+    size_t n;
+    int saved;
+    int result;
+    
+    fflush(stdout);
+    saved = dup(fileno(stdout));
+    if (saved < 0 || !freopen(path, "w", stdout)) {
+        return -1;
+    }
+    result = where_is(opts);
+    fflush(stdout);
+    dup2(saved, fileno(stdout));
+    close(saved);
+    fp = fopen(path, "rb");
+    n = fp ? fread(out, 1, size - 1, fp) : 0;
+    out[n] = '\0';
+    if (fp) {
+        fclose(fp);
+    }
+    remove(path);
+    return result;
+}
+
+/* Two hosts audited, saved, mapped back and asked --where_is */
+static void test_snapshot(void) {
+    static const char *const hosts[] = { "web1", "db1" };
+    static const char *const files[] = {
+        "ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov alice@laptop\n",
+        "# managed\n"
+        "no-pty ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIIeL3KJZCUtf3IrTJ4eV/NfuR63prbAPeo2XWFe9vgov a\n"
+        "ecdsa-sha2-nistp256 AAAAE2VjZHNhLXNoYTItbmlzdHAyNTYAAAAIbmlzdHAyNTYAAABBBPf1BXG8MkGH"
+        "0M+P75pNLBi1hnf33Yy4TGXhMvKwyT3QsJ0ukdOKhs8wWA+8nePJzmNw4/Iu6ivJV9INsTDT0Wg= ci\n",
+    };
+    const char *path = "tests/vectors.audit";
+    unsigned char digest[SHA256_LEN];
+    char out[1024];
+    KeyParser parser;
+    KeyLine key;
+    Options opts;
+    Snapshot snap;
+    Audit audit;
+    size_t index;
+    size_t i;
+    
+    memset(&audit, 0, sizeof(audit));
+    memset(&opts, 0, sizeof(opts));
+    strcpy(opts.user, "root");
+    opts.port = 22;
+    for (i = 0; i < 2; i++) {
+        strcpy(opts.host, hosts[i]);
+        CHECK(audit_host(&audit, &opts, &index) == 0);
+        audit.hosts[index].status = 0;
+        keys_init(&parser, files[i], strlen(files[i]));
+        while (keys_next(&parser, &key)) {
+            CHECK(audit_add(&audit, index, &key) == 0);
+        }
+    }
+    audit_sort(&audit);
+    CHECK(audit_save(&audit, path) == 0);
+    audit_free(&audit);
+    
+    CHECK(snapshot_open(&snap, path) == 0);
+    CHECK(snap.key_count == 2 && snap.host_count == 2 && snap.entry_count == 3);
+    CHECK(parse_fingerprint(key_vectors[1].fingerprint, digest) == 0 &&
+          snapshot_find_key(&snap, digest) >= 0);
+    CHECK(parse_fingerprint(key_vectors[2].fingerprint, digest) == 0 &&
+          snapshot_find_key(&snap, digest) == -1);
+    snapshot_close(&snap);
+    
+    strcpy(opts.audit_file, path);
+    strcpy(opts.where_is, key_vectors[0].fingerprint);
+    CHECK(where_is_output(&opts, "tests/vectors.out", out, sizeof(out)) == 0);
+    CHECK(strcmp(out,
+                 "SHA256:maoUjKdH9InoEmZ/SSkxrHCmLETe9IY6U1u0xYrTlVM ssh-ed25519 alice@laptop\n"
+                 "root@db1:22 2 no-pty\n"
+                 "root@web1:22 1\n") == 0);
+    strcpy(opts.where_is, key_vectors[2].fingerprint);
+    opts.quiet = 1;
+    CHECK(where_is_output(&opts, "tests/vectors.out", out, sizeof(out)) == 1 && out[0] == '\0');
+    remove(path);
+}
+
+int main(void) {
+    test_base64();
+    test_fingerprints();
+    test_cksum();
+    test_parser();
+    test_stream();
+    test_snapshot();
+    if (failures) {
+        fprintf(stderr, "vectors: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("vectors: all checks passed\n");
+    return 0;
+}